@@ -6,7 +6,12 @@
 /* Tommy Thorn 2014-07-28              */
 /* =================================== */
 
+#define _POSIX_C_SOURCE 200809L // clock_gettime()
+
 #include <stdarg.h>
+#include <setjmp.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +19,16 @@
 #include <assert.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86 1
+#endif
 
 /* Compile-time options */
 
@@ -23,19 +38,57 @@
 #define MAXLUTS 2
 #define MAXREGS 8
 
-#define MAXHEAPAPPS 32000
-#define MAXSTACKELEMS 8000
 #define MAXTEMPLATES 8000
 
+/* Default sizes of the heap and stacks.  These can be overridden at
+   run time with -H/-S/-U/-L or the REDUCERON_HEAP, REDUCERON_STACK,
+   REDUCERON_USTACK and REDUCERON_LSTACK environment variables.  The
+   heap grows (up to -M apps, if given, and never beyond what a PTR
+   atom can address) when a collection leaves it more than half full.
+   A nursery of -N (REDUCERON_NURSERY) apps turns on the generational
+   collector.  -C (REDUCERON_CACHE) sets the number of lines in the
+   heap cache of the switch engine, 0 for none.  -q squeezes the
+   update stack as collections walk it (see squeezeUStack()).  -p
+   profiles cost centres, -P also writing flamegraph stacks to a file.
+   -g takes a heap census at every collection (see censusRow()).  -k
+   writes snapshots, at -K ticks or on SIGUSR1, and -r resumes one (see
+   writeSnapshot()); -x instead stops at -K ticks, writing the rest of
+   the run as a program (see writeResidual()), and -c writes the
+   program as C to link with this emulator (see writeC()).  Output is
+   buffered, -i flushing it every so many milliseconds (see
+   flushOutput()).  -m maps devices for ld32/st32 (see findDevice()),
+   and -a moves serial I/O to threads of its own (see serialReader()). */
+
+#define DEFHEAPAPPS    32000
+#define DEFSTACKELEMS  8000
+#define DEFUSTACKELEMS 8000
+#define DEFLSTACKELEMS 8000
+#define DEFCACHELINES  1024
+
+#define HEAPMARGIN     200
+#define STACKMARGIN    100
+
 #define NAMELEN 128
 
+#define OUTBUFSIZE 8192
+
+#define MAXDEVICES 16
+
+#define SERIALRING 65536                // bytes, a power of two
+
 #define perform(action) (action, 1)
 
 #include "red_atom.h"
+#include "reduceron.h"
+
+#define MAXHEAPLIMIT   (1 << (29 - HT)) // Positive range of getPTRId()
+
+/* Templates hold no pointers so that a program image (see below) can
+   be mapped and used in place */
 
 typedef struct
   {
-    Char name[NAMELEN];
+    UInt name;                          // offset into names
     Int arity;
     Int numLuts;
     Lut luts[MAXLUTS];
@@ -45,746 +98,5633 @@ typedef struct
     App apps[MAXAPS];
   } Template;
 
-typedef struct { Int saddr; Int haddr; } Update;
+typedef struct { Int saddr; Int haddr; Int ccs; } Update; // ccs: -p only
 
 Atom falseAtom, trueAtom, mainAtom;
 
+/* A loaded program.  Its templates are only read while running, so
+   any number of machines can share one. */
+
+typedef struct RedProgram
+  {
+    Template *code;
+    Char *names;                        // NUL terminated template names
+    Int numTemplates, namesSize, namesMax;
+    double loadTime;
+    void *image;                        // the mapping, if from an image
+    size_t imageSize;
+  } Program;
+
+typedef struct
+  {
+    Int callCount;
+  } ProfEntry;
+
+/* A node of the cost-centre stack tree (see dispatchProfiled()) */
+
+typedef struct
+  {
+    Int parent, cc, depth;
+    Int child, sibling;                 // first child, next sibling
+    Long ticks, allocs, survivors;      // exclusive costs
+  } CostNode;
+
+/* The reduction rules, as counted in pairs by the profile */
+
+typedef enum { RULE_UNWIND, RULE_UPDATE, RULE_PRIM, RULE_SELECT, RULE_APPLY,
+               NUMRULES } Rule;
 
+static const char *ruleNames[NUMRULES] = {
+    "unwind", "update", "prim", "select", "apply" };
 
-/* Globals */
+typedef struct { Int from, to; Long count; } TemplatePair;
+
+typedef struct Profile
+  {
+    Int numCCs;
+    Int *ccOf;                          // cost centre, by template
+    Int *ccName;                        // a template of each cost centre
+    CostNode *nodes;
+    Int numNodes, maxNodes;
+    Int cur;                            // the current stack
+    Int *lccs;                          // stack to return to, by case
+                                        // stack entry
+    Long rulePairs[NUMRULES][NUMRULES]; // steps by rule and next rule
+    Rule lastRule;
+    TemplatePair *templatePairs;        // applications by template and
+    Int pairsSize, numPairs;            // next template, hashed
+    Int lastTemplate;
+  } Profile;
 
-App* heap;
-App* heap2;
-Atom* stack;
-Update* ustack;
-Lut* lstack;
-Template* code;
-Atom *registers;
+/* A class of heap app in the census (see censusApp()) */
 
-Int hp, gcLow, gcHigh, sp, usp, lsp, end, gcCount;
+typedef struct
+  {
+    UInt key;                           // the head atom, normalised
+    Long apps;                          // copied by this collection
+    Long peak, atPeak;                  // over major collections
+    Int peakGC;
+  } CensusClass;
 
-Int numTemplates;
+typedef struct Census
+  {
+    FILE *f;
+    CensusClass *classes;
+    Int numClasses, maxClasses;
+    Int *hash, hashSize;                // class indices, -1 if empty
+    Long sizes[APSIZE+1];               // apps copied, by atoms; long
+    Long peakApps;
+    Int peakGC;
+  } Census;
 
-/* Profiling info */
+/* A device in the address space of ld32/st32 (see findDevice()) */
 
-Long swapCount, primCount, applyCount, unwindCount,
-     updateCount, selectCount, prsCandidateCount, prsSuccessCount;
+typedef enum { DEV_SERIAL, DEV_RAM, DEV_FILE, DEV_RING } DeviceType;
 
-Bool tracingEnabled = 0;
+typedef struct
+  {
+    uint32_t head, pad1[15];            // words written, by the producer
+    uint32_t tail, pad2[15];            // words read, by the consumer
+  } RingIndex;
 
 typedef struct
   {
-    Bool seen;
-    Int callCount;
-  } ProfEntry;
+    uint32_t magic, words;              // words in each ring, a power of 2
+    uint32_t pad[14];
+    RingIndex in, out;                  // to and from the machine
+    uint32_t data[];                    // in's words, then out's
+  } SharedRing;
+
+typedef struct
+  {
+    DeviceType type;
+    UInt base, size;                    // in words
+    uint32_t *mem;                      // RAM and file words
+    SharedRing *ring;
+    size_t mapSize;                     // of the mapping, if mapped
+  } Device;
+
+/* Serial I/O through threads of its own (see serialReader()) */
+
+typedef struct SerialIO
+  {
+    RingIndex inIndex, outIndex;
+    unsigned char in[SERIALRING], out[SERIALRING];
+    Bool eof, stop;
+    Int sleepers;                       // threads waiting on wake
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t reader, writer;
+    Bool hasReader;
+  } SerialIO;
+
+/* An unpacked app, as held in the heap cache */
+
+typedef struct
+  {
+    Int addr;                           // of the app held, or -1
+    Bool dirty;
+    AppTag tag;
+    Int size;
+    Bool nf;
+    Int info;                           // LUT or result register
+    Atom atom[APSIZE];                  // with their INT tags
+    Int extra;                          // of a long app, the atoms after
+                                        // the first cell (read from the
+                                        // heap, see longAtom())
+  } CacheLine;
+
+#define HISTBUCKETS 32
+
+/* A template's application as native code, from -d jit or red2c (see
+   jitTemplate() and writeC()) */
+
+typedef Int (*JitCode)(Atom *args, App *heap, Int hp, Lut *luts, Long *prs,
+                       Atom *regs);
+
+/* The state of one machine running one program */
+
+typedef struct RedMachine
+  {
+    /* The program, shared with other machines */
+    const Program *prog;
+    const Template *code;
+    const Char *names;
+    Int numTemplates;
+
+    /* How it runs: the engine returns once the program has finished
+       (1) or has used up its ticks to tickLimit (0) */
+    Bool (*engine)(struct RedMachine *);
+    Long tickLimit;
+    RedStatus status;                   // RED_BUDGET while it can run on
+    Int initialHeapApps;
+
+    App* heap;
+    App* heap2;
+    App* mappedHeap;                    // restored, in the snapshot
+    Atom* stack;
+    Update* ustack;
+    Lut* lstack;
+    Atom *registers;
+
+    Int hp, gcLow, gcHigh, sp, usp, lsp, gcCount;
+
+    Int maxHeapApps;
+    Int maxStackElems;
+    Int maxUStackElems;
+    Int maxLStackElems;
+    Int heapLimit;
+
+    /* Generational collection.  The nursery is the top nurseryApps of
+       the heap, from nurseryBase up, and new apps are allocated there;
+       the old generation grows from the bottom of the heap up to
+       oldTop.  Old apps that may point into the nursery are
+       remembered. */
+    Int nurseryApps, nurseryBase, oldTop;
+    Int *remembered, numRemembered, maxRemembered;
+
+    /* The heap cache (see below), if cacheLines isn't 0 */
+    CacheLine *cache;
+    Int cacheLines;
+    Long cacheHits, cacheMisses, cacheWriteBacks;
+
+    /* Apps below gcFrom don't move in this collection; the rest are
+       copied to toSpace */
+    Int gcFrom;
+    App *toSpace;
+
+    /* -q: frames squeezed out of the update stack, in stack address
+       order, whose apps are updated along with the frame left at the
+       same address (see squeezeUStack()) */
+    Bool squeeze;
+    Long squeezed;
+    Update *squeezedFrames, *squeezedFrames2;
+    Int numSqueezed, maxSqueezed;
+
+    /* GC statistics, per generation (minor is the nursery), and the
+       most apps live after any collection */
+    Int minorCount, majorCount, maxLive;
+    Long minorCopied, majorCopied;
+    double minorTime, majorTime;
+
+    /* Phase timing and per collection histograms, bucket i counting
+       values in [2^(i-1), 2^i) (pauses in microseconds, survivors in
+       apps) */
+    double runTime, gcTime;
+    Long gcCycles;
+    Long pauseHist[HISTBUCKETS], survivorHist[HISTBUCKETS];
+
+    /* Profiling info */
+    Long swapCount, primCount, applyCount, unwindCount,
+         updateCount, selectCount, prsCandidateCount, prsSuccessCount;
+    Long prsSelectCount, prsSelectHits; // see spineCompare()
+    Int selectTemplates;
+    ProfEntry *profTable;
+    Profile *prof;                      // -p
+    const char *foldedFile;             // -P
+    Census *census;                     // -g
+    const char *censusFile;
+
+    Bool tracingEnabled;
+
+    /* Templates as decoded by the threaded engine */
+    struct ThreadedTemplate *threaded;
+    void *threadedInstrs, *threadedApps;
+
+    /* -d jit: templates compiled on their first call, and how much of
+       the applying the compiled code did (the time sampled).  A red2c
+       program has its code from the start. */
+    Bool jit;
+    const JitCode *nativeCode;
+    struct Jit *jitState;
+    Long jitApplyCount, jitCycles, interpCycles;
+
+    /* Serial I/O, and where to go when input runs out.  Output is
+       buffered (see emitChar()). */
+    FILE *in, *out;
+    jmp_buf halt;
+    char outBuf[OUTBUFSIZE];
+    Int outLen;
+    double flushInterval, lastFlush;    // seconds, < 0 for no interval
+    Bool asyncSerial;                   // -a
+    SerialIO *serial;                   // if running with -a
+
+    /* Memory-mapped devices, as given with -m and as opened */
+    const char *deviceSpecs[MAXDEVICES];
+    Int numDeviceSpecs, numDevices;
+    Device devices[MAXDEVICES+1];
+    Device *lastDevice;
+  } Machine;
+
+static const char *__restrict program_name = "emu-32-bit";
 
-ProfEntry *profTable;
+/* Errors.  Library calls and batch jobs catch them rather than exit:
+   they point errorHandler at a jmp_buf for the duration of the call,
+   and when setjmp() returns again the status is in errorStatus. */
 
-static const char *__restrict program_name;
+static __thread jmp_buf *errorHandler;
+static __thread RedStatus errorStatus;
+static __thread char errorMessage[512];
+static __thread Machine *runningMachine;  // its output flushed first
+
+void syncOutput(Machine *m);
 
 static void __attribute__ ((__noreturn__))
-    error(const char *__restrict fmt, ...)
+    fail(RedStatus status, const char *__restrict fmt, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s: error: ", program_name);
-
     va_start(ap, fmt);
-    (void) vfprintf(stderr, fmt, ap);
+    (void) vsnprintf(errorMessage, sizeof errorMessage, fmt, ap);
     va_end(ap);
-    fputc('\n', stderr);
 
+    if (runningMachine) {
+        Machine *m = runningMachine;
+        runningMachine = NULL;
+        syncOutput(m);
+    }
+
+    if (errorHandler) {
+        errorStatus = status;
+        longjmp(*errorHandler, 1);
+    }
+
+    fprintf(stderr, "%s: error: %s\n", program_name, errorMessage);
     exit(EXIT_FAILURE);
 }
 
-/* Display profiling table */
+#define error(...) fail(RED_EINVALID, __VA_ARGS__)
 
-void displayProfTable()
+/* Timing */
+
+double now(void)
 {
-  Int i, j, ticksPerCall;
-  printf("\nPROFILING TABLE:\n");
-  printf("+----------------------------------+------+----------+\n");
-  printf("| %-32s | %4s | %8s |\n", "FUNCTION", "SIZE", "%TIME");
-  printf("+----------------------------------+------+----------+\n");
-  for (i = 0; i < numTemplates; i++) {
-    if (! profTable[i].seen) {
-      ticksPerCall = 0;
-      for (j = i; j < numTemplates; j++) {
-        if (!strcmp(code[j].name,code[i].name)) {
-          ticksPerCall++;
-          profTable[j].seen = 1;
-        }
-      }
-      printf("| %-32s |   %2i | %8.2f |\n",
-        code[i].name, ticksPerCall,
-        (100*(double)(profTable[i].callCount*ticksPerCall))/
-        (double)applyCount);
-    }
-  }
-  printf("+----------------------------------+------+----------+\n");
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-/* Dashing */
+/* Time stamp counter, where there is one */
 
-Atom dash(Bool sh, Atom a)
+static inline Long cycles(void)
 {
-    if (sh && isPTR(a) && !getPTRShared(a))
-        return mkPTR(1, getPTRId(a));
-    else
-        return a;
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
 }
 
-void dashApp(App* app)
+static Int histBucket(Long n)
 {
-  Int i;
-  for (i = 0; i < getAppSize(*app); i++)
-      if (isPTR(getAppAtom(*app, i)))
-          shareAppAtom(app, i);
+    Int i = 0;
+
+    while (n > 0 && i < HISTBUCKETS-1) {
+        n >>= 1;
+        i++;
+    }
+    return i;
 }
 
-/* Unwinding */
+void displayHist(FILE *f, const char *title, const Long *hist)
+{
+    Int i;
 
-static inline Bool nf(App* app)
+    fprintf(f, "%-23s %10s\n", title, "count");
+    for (i = 0; i < HISTBUCKETS; i++)
+        if (hist[i])
+            fprintf(f, "  %9lld - %-9lld %10lld\n",
+                   i ? 1LL << (i-1) : 0, (1LL << i) - 1, hist[i]);
+}
+
+/* Cost-centre profiling
+
+   With -p every template is charged to a cost centre, the source
+   function it came from (its name up to any '#'), and the machine
+   keeps a stack of cost centres: applying a template pushes its cost
+   centre (unless already on top), while case alternatives and updates
+   return to the stack current when the case table or the update frame
+   was pushed.  Each stack is a node of a tree, charged with the ticks
+   and the apps allocated in it and the apps a collection copied while
+   it was current.  The report gives exclusive and inclusive costs per
+   cost centre, and -P writes every stack in the folded format of
+   flamegraph.pl.  The steps are also counted in pairs, by rule and by
+   template applied, which shows what the engines fuse (see dispatch())
+   and which calls come in runs. */
+
+#define MAXCCSDEPTH 128
+
+Long ticks(const Machine *m);
+
+static Int ccNameLen(const Char *name)
 {
-    return getAppTag(*app) == CASE ? 0 : getAppNF(*app);
+  const Char *hash = strchr(name, '#');
+
+  return hash && hash > name ? hash - name : (Int) strlen(name);
 }
 
-void pushAtoms(App app)
+static const Char *ccNameOf(const Machine *m, Int cc)
 {
-  Int i;
-  for (i = getAppSize(app)-1; i >= 0; i--)
-      stack[sp++] = getAppAtom(app, i);
+  return m->names + m->code[m->prof->ccName[cc]].name;
 }
 
-void unwind(Bool sh, Int addr)
+Int newCostNode(Profile *p, Int parent, Int cc)
 {
-  App app = heap[addr];
-  if (sh && !nf(&app)) {
-    Update u; u.saddr = sp; u.haddr = addr;
-    ustack[usp++] = u;
+  CostNode *n;
+
+  if (p->numNodes == p->maxNodes) {
+    p->maxNodes = 2*p->maxNodes + 1024;
+    p->nodes = realloc(p->nodes, sizeof(CostNode) * p->maxNodes);
+    if (!p->nodes) fail(RED_ENOMEM, "out of memory for the profile");
   }
-  if (sh)
-      dashApp(&app);
-  if (getAppTag(app) == CASE)
-      lstack[lsp++] = getAppLUT(app);
-  sp--;
-  assert(getAppSize(app));
-  pushAtoms(app);
+  n = &p->nodes[p->numNodes];
+  memset(n, 0, sizeof *n);
+  n->parent = parent;
+  n->cc = cc;
+  n->depth = parent < 0 ? 0 : p->nodes[parent].depth + 1;
+  n->child = n->sibling = -1;
+  if (parent >= 0) {
+    n->sibling = p->nodes[parent].child;
+    p->nodes[parent].child = p->numNodes;
+  }
+  return p->numNodes++;
 }
 
-/* Updating */
+static inline Int enterCC(Profile *p, Int cur, Int cc)
+{
+  Int c;
 
-static inline Int arity(Atom a)
+  if (p->nodes[cur].cc == cc || p->nodes[cur].depth >= MAXCCSDEPTH)
+    return cur;
+  for (c = p->nodes[cur].child; c >= 0; c = p->nodes[c].sibling)
+    if (p->nodes[c].cc == cc) return c;
+  return newCostNode(p, cur, cc);
+}
+
+void freeProfile(Machine *m)
 {
-    if (isINT(a))
-        return 1;
-    else if (isCON(a))
-        return getCONArity(a) + 1;
-    else if (isFUN(a))
-        return getFUNArity(a);
-    else if (isPRI(a))
-        return getPRIArity(a);
-    else
-        error("arity(): invalid tag");
-    return 0;
+  Profile *p = m->prof;
+
+  if (!p) return;
+  free(p->ccOf);
+  free(p->ccName);
+  free(p->nodes);
+  free(p->lccs);
+  free(p->templatePairs);
+  free(p);
+  m->prof = NULL;
 }
 
-Bool updateCheck(Atom top, Update utop)
+static inline void countRule(Profile *p, Rule r)
 {
-  return (arity(top) > sp - utop.saddr);
+  p->rulePairs[p->lastRule][r]++;
+  p->lastRule = r;
 }
 
-void upd(Atom top, Int sp, Int len, Int hp)
+void countTemplatePair(Profile *p, Int to)
 {
-  Int i, j;
-  Atom atoms[APSIZE];
+  Int from = p->lastTemplate, i, k;
 
-  atoms[0] = top;
-  for (i = 1, j = sp; i < len; i++, j--) {
-    atoms[i] = stack[j] = dash(1, stack[j]);
-  }
+  p->lastTemplate = to;
+  if (from < 0) return;
+  if (2*(p->numPairs+1) > p->pairsSize) {
+    TemplatePair *old = p->templatePairs;
+    Int oldSize = p->pairsSize;
 
-  heap[hp] = mkApp(AP, len, 1, 0, atoms);
+    p->pairsSize = oldSize ? 2*oldSize : 1024;
+    p->templatePairs = malloc(sizeof(TemplatePair) * p->pairsSize);
+    if (!p->templatePairs) fail(RED_ENOMEM, "out of memory for the profile");
+    for (i = 0; i < p->pairsSize; i++) p->templatePairs[i].count = 0;
+    for (k = 0; k < oldSize; k++) {
+      if (!old[k].count) continue;
+      i = ((old[k].from * 31 + old[k].to) * 2654435761u) & (p->pairsSize-1);
+      while (p->templatePairs[i].count) i = (i+1) & (p->pairsSize-1);
+      p->templatePairs[i] = old[k];
+    }
+    free(old);
+  }
+  i = ((from * 31 + to) * 2654435761u) & (p->pairsSize-1);
+  for (;;) {
+    TemplatePair *t = &p->templatePairs[i];
+    if (!t->count) {
+      t->from = from;
+      t->to = to;
+      p->numPairs++;
+    }
+    if (t->from == from && t->to == to) {
+      t->count++;
+      return;
+    }
+    i = (i+1) & (p->pairsSize-1);
+  }
 }
 
-void update(Atom top, Int saddr, Int haddr)
+/* Find the cost centres of the program, hashing the names once */
+
+void newProfile(Machine *m)
 {
-    Int len = 1 + sp - saddr;
-    Int p = sp-2;
+  Profile *p = calloc(1, sizeof(Profile));
+  Int size = 16, *hash, t, i, len;
 
-    for (;;) {
-        if (len < APSIZE) {
-            if (len <= 0)
-                error("zero sized app updated");
-            else
-                upd(top, p, len, haddr);
-            usp--;
-        } else {
-            upd(top, p, APSIZE, hp);
-            p -= APSIZE-1; len -= APSIZE-1;
-            top = mkPTR(1, hp);
-            hp++;
-        }
+  freeProfile(m);
+  if (!(m->prof = p)) fail(RED_ENOMEM, "out of memory for the profile");
+  while (size < 2*m->numTemplates) size *= 2;
+  hash = malloc(sizeof(Int) * size);
+  p->ccOf = malloc(sizeof(Int) * m->numTemplates);
+  p->ccName = malloc(sizeof(Int) * m->numTemplates);
+  p->lccs = calloc(m->maxLStackElems, sizeof(Int));
+  if (!hash || !p->ccOf || !p->ccName || !p->lccs) {
+    free(hash);
+    fail(RED_ENOMEM, "out of memory for the profile");
+  }
+  for (i = 0; i < size; i++) hash[i] = -1;
+
+  for (t = 0; t < m->numTemplates; t++) {
+    const Char *name = m->names + m->code[t].name;
+    UInt h = 2166136261u;
+
+    len = ccNameLen(name);
+    for (i = 0; i < len; i++) h = (h ^ (unsigned char) name[i]) * 16777619u;
+    for (i = h & (size-1); hash[i] >= 0; i = (i+1) & (size-1)) {
+      const Char *other = ccNameOf(m, hash[i]);
+      if (ccNameLen(other) == len && strncmp(other, name, len) == 0) break;
     }
+    if (hash[i] < 0) {
+      hash[i] = p->numCCs;
+      p->ccName[p->numCCs++] = t;
+    }
+    p->ccOf[t] = hash[i];
+  }
+  free(hash);
+  p->cur = newCostNode(p, -1, -1);
+  p->lastRule = RULE_APPLY;             // main is applied first
+  p->lastTemplate = -1;
 }
 
-/* Primitive reduction */
+typedef struct { Int cc; Long calls, ticks, allocs, survivors; } CostRow;
 
-Atom prim_ld32(Int addr)
+static int byTicks(const void *a, const void *b)
 {
-    /* For now, a quick hack:
-       [0] - serial in
-    */
-    Atom res = mkINT(666);
+  const CostRow *x = a, *y = b;
 
-    if (addr == 0)
-        res = mkINT(getchar());
+  return x->ticks < y->ticks ? 1 : x->ticks > y->ticks ? -1 :
+         x->allocs < y->allocs ? 1 : x->allocs > y->allocs ? -1 : 0;
+}
 
-    if (tracingEnabled) {
-        printf("[[ld32 (%d) -> %d]]", addr, getINTValue(res));
-        fflush(stdout);
-    }
+static void displayCostTable(Machine *m, const char *title, CostRow *rows,
+                             Long allocs, Long survivors)
+{
+  FILE *f = m->out;
+  Long n = ticks(m);
+  Int i;
 
-    /* This is a hack to terminate otherwise infinite processes */
-    if (getINTValue(res) < 0)
-        exit(0);
+  qsort(rows, m->prof->numCCs, sizeof(CostRow), byTicks);
+  fprintf(f, "\n%s:\n", title);
+  fprintf(f, "+----------------------------------+------------+--------+--------+--------+\n");
+  fprintf(f, "| %-32s | %10s | %6s | %6s | %6s |\n",
+          "FUNCTION", "CALLS", "%TICKS", "%ALLOC", "%GC");
+  fprintf(f, "+----------------------------------+------------+--------+--------+--------+\n");
+  for (i = 0; i < m->prof->numCCs; i++) {
+    const CostRow *r = &rows[i];
+    const Char *name = ccNameOf(m, r->cc);
 
-    return res;
+    if (!r->ticks && !r->allocs && !r->survivors) continue;
+    fprintf(f, "| %-32.*s | %10lld | %6.2f | %6.2f | %6.2f |\n",
+            ccNameLen(name), name, r->calls,
+            (100.0*r->ticks)/(n ? n : 1),
+            (100.0*r->allocs)/(allocs ? allocs : 1),
+            (100.0*r->survivors)/(survivors ? survivors : 1));
+  }
+  fprintf(f, "+----------------------------------+------------+--------+--------+--------+\n");
 }
 
-Atom prim_st32(Int addr, Int value, Atom k)
-{
-    /* For now, a quick hack:
-       [0] - serial out
-    */
+/* Write the stack of every node with ticks of its own as a line of
+   cost centres from the root, and the ticks */
 
-    if (addr == 0)
-        putchar(value);
+void writeFolded(Machine *m, const char *file)
+{
+  Profile *p = m->prof;
+  Int path[MAXCCSDEPTH+1], i, k, depth;
+  FILE *f = fopen(file, "w");
 
-    if (tracingEnabled) {
-        printf("[[st32 (%d)=%d]]", addr, value);
-        fflush(stdout);
+  if (!f) fail(RED_EIO, "%s: %s", file, strerror(errno));
+  for (i = 1; i < p->numNodes; i++) {
+    if (!p->nodes[i].ticks) continue;
+    for (depth = 0, k = i; k > 0; k = p->nodes[k].parent)
+      path[depth++] = p->nodes[k].cc;
+    while (depth--) {
+      const Char *name = ccNameOf(m, path[depth]);
+      fprintf(f, "%.*s%s", ccNameLen(name), name, depth ? ";" : "");
     }
-
-    return k;
+    fprintf(f, " %lld\n", p->nodes[i].ticks);
+  }
+  if (fclose(f) != 0) fail(RED_EIO, "%s: %s", file, strerror(errno));
 }
 
-Atom prim(Prim p, Atom a, Atom b, Atom c)
+static int byCount(const void *a, const void *b)
 {
-  Atom result = 0;
-  Int n, m;
-  n = getINTValue(a);
-  m = getINTValue(b);
-  switch (p) {
-    case ADD: result = mkINT(n+m); break;
-    case SUB: result = mkINT(n-m); break;
-    case EQ: result = n == m ? trueAtom : falseAtom; break;
-    case NEQ: result = n != m ? trueAtom : falseAtom; break;
-    case LEQ: result = n <= m ? trueAtom : falseAtom; break;
-    case EMIT: printf("%c", n); fflush(stdout); result = b; break;
-    case EMITINT: printf("%i", n); fflush(stdout); result = b; break;
-    case AND: result = mkINT(n & m); break;
-    case ST32: result = prim_st32(n, m, c); break;
-    case LD32: result = prim_ld32(n); break;
-    default: assert(0);
-  }
+  const TemplatePair *x = a, *y = b;
 
-  return result;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
 }
 
-void applyPrim()
+#define MAXPAIRS 20                     // template pairs reported
+
+void displayPairs(Machine *m)
 {
-  Atom p = stack[sp-2];
-  Prim pid = getPRIId(p);
-  if (pid == SEQ) {
-    stack[sp-2] = stack[sp-3];
-    stack[sp-3] = stack[sp-1];
-    sp-=1;
-    primCount++;
-  }
-  else if (isINT(stack[sp-3])
-        || pid == EMIT || pid == EMITINT) {
-    if (getPRISwap(p))
-        stack[sp-3] = prim(pid, stack[sp-3], stack[sp-1], stack[4 <= sp ? sp-4 : 0]);
-    else
-        stack[sp-3] = prim(pid, stack[sp-1], stack[sp-3], stack[4 <= sp ? sp-4 : 0]);
-    sp -= getPRIArity(p);
-    primCount++;
+  Profile *p = m->prof;
+  FILE *f = m->out;
+  TemplatePair *pairs = malloc(sizeof(TemplatePair) * (p->numPairs + 1));
+  Long total = 0, calls = 0;
+  Int i, j, n = 0;
+
+  if (!pairs) fail(RED_ENOMEM, "out of memory for the profile");
+  for (i = 0; i < NUMRULES; i++)
+    for (j = 0; j < NUMRULES; j++)
+      total += p->rulePairs[i][j];
+  fprintf(f, "\nRULE PAIRS (%% of steps, by rule and the next):\n%-8s", "");
+  for (j = 0; j < NUMRULES; j++) fprintf(f, " %7s", ruleNames[j]);
+  fputc('\n', f);
+  for (i = 0; i < NUMRULES; i++) {
+    fprintf(f, "%-8s", ruleNames[i]);
+    for (j = 0; j < NUMRULES; j++)
+      fprintf(f, " %7.2f", (100.0*p->rulePairs[i][j])/(total ? total : 1));
+    fputc('\n', f);
   }
-  else {
-      Atom tmp;
-      stack[sp-2] = togglePRISwap(stack[sp-2]);
-      tmp = stack[sp-1];
-      stack[sp-1] = stack[sp-3];
-      stack[sp-3] = tmp;
-      swapCount++;
+
+  for (i = 0; i < p->pairsSize; i++)
+    if (p->templatePairs[i].count) {
+      calls += p->templatePairs[i].count;
+      pairs[n++] = p->templatePairs[i];
+    }
+  qsort(pairs, n, sizeof(TemplatePair), byCount);
+  fprintf(f, "\nTEMPLATE PAIRS (top %d of %d):\n", n < MAXPAIRS ? n : MAXPAIRS, n);
+  for (i = 0; i < n && i < MAXPAIRS; i++) {
+    const TemplatePair *t = &pairs[i];
+    fprintf(f, "%6.2f%%  %s (%d) -> %s (%d)\n",
+            (100.0*t->count)/(calls ? calls : 1),
+            m->names + m->code[t->from].name, t->from,
+            m->names + m->code[t->to].name, t->to);
   }
+  free(pairs);
 }
 
-/* Case-alt selection */
-
-void caseSelect(Int index)
+void displayProfile(Machine *m)
 {
-  Int lut = lstack[lsp-1];
-  stack[sp-1] = mkFUN(1,0,lut+index);
-  lsp--;
-}
-
-/* Function application */
+  Profile *p = m->prof;
+  CostRow *excl = calloc(p->numCCs, sizeof(CostRow));
+  CostRow *incl = calloc(p->numCCs, sizeof(CostRow));
+  Int *seen = malloc(sizeof(Int) * p->numCCs);
+  Long allocs = 0, survivors = 0;
+  Int i, k, t;
 
-Atom inst(Int base, Int argPtr, Atom a)
-{
-    if (isPTR(a)) {
-        a = mkPTR(getPTRShared(a), base + getPTRId(a));
+  if (!excl || !incl || !seen) fail(RED_ENOMEM, "out of memory for the profile");
+  for (i = 0; i < p->numCCs; i++) {
+    excl[i].cc = incl[i].cc = i;
+    seen[i] = -1;
   }
-  else if (isARG(a)) {
-      a = dash(getARGShared(a), stack[argPtr - getARGIndex(a)]);
+  for (t = 0; t < m->numTemplates; t++) {
+    excl[p->ccOf[t]].calls += m->profTable[t].callCount;
+    incl[p->ccOf[t]].calls += m->profTable[t].callCount;
   }
-  else if (isREG(a)) {
-      a = dash(getREGShared(a), registers[getREGIndex(a)]);
+
+  /* A stack's costs count once towards each cost centre on it */
+  for (i = 1; i < p->numNodes; i++) {
+    const CostNode *n = &p->nodes[i];
+
+    excl[n->cc].ticks += n->ticks;
+    excl[n->cc].allocs += n->allocs;
+    excl[n->cc].survivors += n->survivors;
+    allocs += n->allocs;
+    survivors += n->survivors;
+    for (k = i; k > 0; k = p->nodes[k].parent) {
+      Int cc = p->nodes[k].cc;
+      if (seen[cc] == i) continue;
+      seen[cc] = i;
+      incl[cc].ticks += n->ticks;
+      incl[cc].allocs += n->allocs;
+      incl[cc].survivors += n->survivors;
+    }
   }
-  return a;
-}
 
-Atom getPrimArg(Int argPtr, Atom a)
-{
-    if (isARG(a)) return stack[argPtr - getARGIndex(a)];
-    else if (isREG(a)) return registers[getREGIndex(a)];
-  else return a;
+  displayCostTable(m, "COST CENTRES (EXCLUSIVE)", excl, allocs, survivors);
+  displayCostTable(m, "COST CENTRES (INCLUSIVE)", incl, allocs, survivors);
+  displayPairs(m);
+  free(excl);
+  free(incl);
+  free(seen);
 }
 
-void instApp(Int base, Int argPtr, App *app)
-{
-  Int i;
-  Atom a, b;
-  App* new = &heap[hp];
-  Int rid;
+/* Heap census
 
-  if (getAppTag(*app) == PRIM) {
-    prsCandidateCount++;
-    a = getAppAtom(*app, 0);
-    b = getAppAtom(*app, 2);
-    a = getPrimArg(argPtr, a);
-    b = getPrimArg(argPtr, b);
-    rid = getAppRegId(*app);
-    if (isINT(a) && isINT(b)) {
-      prsSuccessCount++;
-      registers[rid] = prim(getPRIId(getAppAtom(*app, 1)), a, b, b);
-    }
-    else {
-      Atom atoms[APSIZE];
-      registers[rid] = mkPTR(0, hp);
+   With -g every collection classifies the apps it copies, as copy()
+   scans them, by head atom (constructor, function, partial
+   application, primitive, number, application of a pointer,
+   indirection or case) and by size, and appends a row to the census
+   file: the collection number, ticks, kind, apps copied, apps of 1 to
+   APSIZE atoms, long apps (see updLong()), then a class name and count
+   for every class seen.  A major collection copies every live app, so
+   its row is the residency of the heap and counts towards the peaks
+   reported at exit; a minor collection only sees the apps it
+   promotes. */
 
-      for (i = 0; i < getAppSize(*app); i++)
-          atoms[i] = inst(base, argPtr, getAppAtom(*app, i));
+typedef enum { CENSUS_INT, CENSUS_AP, CENSUS_IND, CENSUS_CASE } CensusPseudo;
 
-      *new = mkApp(AP, getAppSize(*app), 0, 0, atoms);
+static const char *censusPseudoNames[] = { "INT", "AP", "IND", "CASE" };
 
-      hp++;
-    }
-  }
-  else {
-    Atom atoms[APSIZE];
+static const char *primNames[LAST_PRIM] = {
+  "(+)", "(-)", "(==)", "(/=)", "(<=)", "emit", "emitInt", "(!)",
+  "(.&.)", "st32", "ld32", "(*)", "(/)", "(%)", "(.|.)", "(.^.)",
+  "(.<<.)", "(.>>.)" };
 
-    for (i = 0; i < getAppSize(*app); i++)
-        atoms[i] = inst(base, argPtr, getAppAtom(*app, i));
+/* Atoms in app, with those a long app keeps in the cells after it */
 
-    *new = mkApp(getAppTag(*app),
-                 getAppSize(*app),
-                 getAppNF(*app),
-                 getAppLUT(*app),
-                 atoms);
+static inline Int censusAtoms(App app)
+{
+  Atom last = getAppAtom(app, APSIZE-1);
 
-    hp++;
-  }
+  return isLONG(last) ? APSIZE-1 + getLONGSize(last) : getAppSize(app);
 }
 
-void slide(Int p, Int n)
+static inline UInt censusKey(App app, Int size)
 {
-  Int i;
-  for (i = p; i < sp; i++) stack[i-n] = stack[i];
-  sp -= n;
+  Atom head = getAppAtom(app, 0);
+
+  if (getAppTag(app) == CASE)
+    return mkAtom(INV, 0, 0, CENSUS_CASE);
+  if (isINT(head))
+    return mkAtom(INV, 0, 0, CENSUS_INT);
+  if (isPTR(head))
+    return mkAtom(INV, 0, 0, size == 1 ? CENSUS_IND : CENSUS_AP);
+  if (isFUN(head))                      // original flags a partial one
+    return mkFUN(size-1 < (Int) getFUNArity(head), 0, getFUNId(head));
+  if (isCON(head))
+    return mkCON(getCONArity(head), getCONIndex(head));
+  if (isPRI(head))
+    return mkPRI(0, 0, getPRIId(head));
+  return (UInt) head & (~0U << HT);
 }
 
-void apply(Template* t)
+static inline Int censusHash(UInt key)
 {
-  Int i;
-  Int base = hp;
-  Int spOld = sp;
+  UInt h = (key >> HT) * 2654435761u;
 
-  for (i = t->numLuts-1; i >= 0; i--) lstack[lsp++] = t->luts[i];
-  for (i = 0; i < t->numApps; i++)
-    instApp(base, spOld-2, &(t->apps[i]));
-  for (i = t->numPushs-1; i >= 0; i--)
-    stack[sp++] = inst(base, spOld-2, t->pushs[i]);
-
-  slide(spOld, t->arity+1);
+  return h ^ h >> 16;
 }
 
-/* Garbage collection */
-
-Bool isSimple(App *app)
+static void censusName(const Machine *m, UInt key, char *buf, size_t n)
 {
-    return (getAppSize(*app) == 1 && getAppTag(*app) != CASE &&
-            (isINT(getAppAtom(*app, 0)) || isCON(getAppAtom(*app, 0))));
+  if (isFUN(key))
+    snprintf(buf, n, "%s %s", getFUNOriginal(key) ? "PAP" : "FUN",
+             m->names + m->code[getFUNId(key)].name);
+  else if (isCON(key))
+    snprintf(buf, n, "CON %u/%u", getCONArity(key), getCONIndex(key));
+  else if (isPRI(key) && getPRIId(key) < LAST_PRIM)
+    snprintf(buf, n, "PRI %s", primNames[getPRIId(key)]);
+  else if (isINV(key) && atomIndex(key) <= CENSUS_CASE)
+    snprintf(buf, n, "%s", censusPseudoNames[atomIndex(key)]);
+  else
+    snprintf(buf, n, "?%08x", key);
 }
 
-Atom copyChild(Atom child)
+static void rehashCensus(Census *c, Int size)
 {
-  App app;
-  if (isPTR(child)) {
-    app = heap[getPTRId(child)];
-    if (isAppCollected(app))
-        return getAppCollectedAtom(app);
-    else if (isSimple(&app))
-        return getAppAtom(app, 0);
-    else {
-      Int addr = getPTRId(child);
-      child = setPTRId(child, gcHigh);
-      heap[addr] = mkAppCollected(child);
-      heap2[gcHigh++] = app;
-      return child;
-    }
+  Int i, j;
+
+  free(c->hash);
+  c->hash = malloc(sizeof(Int) * size);
+  if (!c->hash) fail(RED_ENOMEM, "out of memory for the heap census");
+  c->hashSize = size;
+  for (i = 0; i < size; i++) c->hash[i] = -1;
+  for (i = 0; i < c->numClasses; i++) {
+    for (j = censusHash(c->classes[i].key) & (size-1); c->hash[j] >= 0;
+         j = (j+1) & (size-1))
+      ;
+    c->hash[j] = i;
   }
-  return child;
 }
 
-void copy()
+static Int addCensusClass(Census *c, UInt key, Int slot)
 {
-  Int i;
-  App app;
-  while (gcLow < gcHigh) {
-      Atom atoms[APSIZE];
-      app = heap2[gcLow];
-      for (i = 0; i < getAppSize(app); i++)
-          atoms[i] = copyChild(getAppAtom(app, i));
-      heap2[gcLow++] = mkApp(getAppTag(app),
-                             getAppSize(app),
-                             getAppNF(app),
-                             getAppLUT(app),
-                             atoms);
+  CensusClass *k;
+
+  if (c->numClasses == c->maxClasses) {
+    c->maxClasses = 2*c->maxClasses + 64;
+    c->classes = realloc(c->classes, sizeof(CensusClass) * c->maxClasses);
+    if (!c->classes) fail(RED_ENOMEM, "out of memory for the heap census");
   }
+  k = &c->classes[c->numClasses];
+  memset(k, 0, sizeof *k);
+  k->key = key;
+  k->peakGC = -1;
+  c->hash[slot] = c->numClasses++;
+  if (2*c->numClasses > c->hashSize) rehashCensus(c, 2*c->hashSize);
+  return c->numClasses - 1;
 }
 
-void updateUStack()
+static inline void censusApp(Census *c, App app)
 {
-  Int i, j;
-  App app;
-  for (i = 0, j = 0; i < usp; i++) {
-    app = heap[ustack[i].haddr];
-    if (isAppCollected(app)) {
-      ustack[j].saddr = ustack[i].saddr;
-      ustack[j].haddr = getPTRId(getAppCollectedAtom(app));
-      j++;
-    }
-  }
-  usp = j;
+  Int size = censusAtoms(app), i;
+  UInt key = censusKey(app, size);
+
+  for (i = censusHash(key) & (c->hashSize-1); c->hash[i] >= 0;
+       i = (i+1) & (c->hashSize-1))
+    if (c->classes[c->hash[i]].key == key) break;
+  i = c->hash[i] >= 0 ? c->hash[i] : addCensusClass(c, key, i);
+  c->classes[i].apps++;
+  c->sizes[size > APSIZE ? APSIZE : size-1]++;
 }
 
-void collect()
+void freeCensus(Machine *m)
 {
-  Int i;
-  App* tmp;
-  gcCount++;
-  gcLow = gcHigh = 0;
-  for (i = 0; i < sp; i++) stack[i] = copyChild(stack[i]);
-  copy();
-  updateUStack();
-  tmp = heap; heap = heap2; heap2 = tmp;
-  hp = gcHigh;
-  //printf("After GC: %i\n", hp);
-}
+  Census *c = m->census;
 
-/* Allocate memory */
+  if (!c) return;
+  if (c->f) fclose(c->f);
+  free(c->classes);
+  free(c->hash);
+  free(c);
+  m->census = NULL;
+}
 
-void alloc()
+void newCensus(Machine *m)
 {
-  heap = (App*) malloc(sizeof(App) * MAXHEAPAPPS);
-  heap2 = (App*) malloc(sizeof(App) * MAXHEAPAPPS);
-  stack = (Atom*) malloc(sizeof(Atom) * MAXSTACKELEMS);
-  ustack = (Update*) malloc(sizeof(Update) * MAXSTACKELEMS);
-  lstack = (Lut*) malloc(sizeof(Lut) * MAXSTACKELEMS);
-  code = (Template*) malloc(sizeof(Template) * MAXTEMPLATES);
-  registers = (Atom*) malloc(sizeof(Atom) * MAXREGS);
-  profTable = (ProfEntry*) malloc(sizeof(ProfEntry) * MAXTEMPLATES);
+  Census *c = calloc(1, sizeof(Census));
+  Int i;
+
+  freeCensus(m);
+  if (!(m->census = c)) fail(RED_ENOMEM, "out of memory for the heap census");
+  rehashCensus(c, 256);
+  c->peakGC = -1;
+  if (!(c->f = fopen(m->censusFile, "w")))
+    fail(RED_EIO, "%s: %s", m->censusFile, strerror(errno));
+  fprintf(c->f, "# gc\tticks\tkind\tapps");
+  for (i = 1; i <= APSIZE; i++) fprintf(c->f, "\tsize%d", i);
+  fprintf(c->f, "\tlong\t[class\tapps]...\n");
 }
 
-/* Initialise globals */
+/* End the census of a collection: write its row and, if it was major,
+   update the peaks */
 
-void initProfTable()
+void censusRow(Machine *m, Bool major)
 {
+  Census *c = m->census;
+  char name[NAMELEN+8];
+  Long apps = 0;
   Int i;
-  for (i = 0; i < MAXTEMPLATES; i++) {
-    profTable[i].seen = 0;
-    profTable[i].callCount = 0;
+
+  for (i = 0; i <= APSIZE; i++) apps += c->sizes[i];
+  fprintf(c->f, "%d\t%lld\t%s\t%lld", m->gcCount, ticks(m),
+          major ? "major" : "minor", apps);
+  for (i = 0; i <= APSIZE; i++) fprintf(c->f, "\t%lld", c->sizes[i]);
+  for (i = 0; i < c->numClasses; i++) {
+    if (!c->classes[i].apps) continue;
+    censusName(m, c->classes[i].key, name, sizeof name);
+    fprintf(c->f, "\t%s\t%lld", name, c->classes[i].apps);
+  }
+  fprintf(c->f, "\n");
+
+  for (i = 0; major && i < c->numClasses; i++) {
+    CensusClass *k = &c->classes[i];
+    if (k->apps > k->peak) {
+      k->peak = k->apps;
+      k->peakGC = m->gcCount;
+    }
   }
+  if (major && apps > c->peakApps) {
+    c->peakApps = apps;
+    c->peakGC = m->gcCount;
+    for (i = 0; i < c->numClasses; i++)
+      c->classes[i].atPeak = c->classes[i].apps;
+  }
+  for (i = 0; i < c->numClasses; i++) c->classes[i].apps = 0;
+  memset(c->sizes, 0, sizeof c->sizes);
 }
 
-void init()
+static int byPeak(const void *a, const void *b)
 {
-  falseAtom = mkCON(0,0);
-  trueAtom = mkCON(0,1);
-  mainAtom = mkFUN(0,0,0);
+  const CensusClass *x = a, *y = b;
 
-
-  sp = 1;
-  usp = lsp = hp = 0;
-  stack[0] = mainAtom;
-  swapCount = primCount = applyCount =
-    unwindCount = updateCount = selectCount =
-      prsCandidateCount = prsSuccessCount = gcCount = 0;
-  initProfTable();
+  return x->peak < y->peak ? 1 : x->peak > y->peak ? -1 :
+         x->atPeak < y->atPeak ? 1 : x->atPeak > y->atPeak ? -1 : 0;
 }
 
-/* Dispatch loop */
-
-static inline Bool canCollect()
+void displayCensus(Machine *m)
 {
-    return !isFUN(stack[sp-1]) || getFUNOriginal(stack[sp-1]);
-}
+  Census *c = m->census;
+  FILE *f = m->out;
+  char name[NAMELEN+8];
+  Int i;
 
-void stackOverflow(void)
-{
-    error("Out of stack space.");
+  if (c->peakGC < 0) {
+    fprintf(f, "\nHEAP CENSUS: no major collections\n");
+    return;
+  }
+  qsort(c->classes, c->numClasses, sizeof(CensusClass), byPeak);
+  rehashCensus(c, c->hashSize);
+  fprintf(f, "\nHEAP CENSUS (PEAK RESIDENCY %lld APPS AT GC %d):\n",
+          c->peakApps, c->peakGC);
+  fprintf(f, "+----------------------------------+------------+--------+------------+\n");
+  fprintf(f, "| %-32s | %10s | %6s | %10s |\n",
+          "CLASS", "PEAK APPS", "AT GC", "AT PEAK");
+  fprintf(f, "+----------------------------------+------------+--------+------------+\n");
+  for (i = 0; i < c->numClasses; i++) {
+    const CensusClass *k = &c->classes[i];
+
+    if (!k->peak) continue;
+    censusName(m, k->key, name, sizeof name);
+    fprintf(f, "| %-32.32s | %10lld | %6d | %10lld |\n",
+            name, k->peak, k->peakGC, k->atPeak);
+  }
+  fprintf(f, "+----------------------------------+------------+--------+------------+\n");
+}
+
+/* Dashing */
+
+Atom dash(Bool sh, Atom a)
+{
+    if (sh && isPTR(a) && !getPTRShared(a))
+        return mkPTR(1, getPTRId(a));
+    else
+        return a;
+}
+
+/* Heap cache
+
+   A direct mapped cache of unpacked apps in front of the packed heap,
+   as red_atom.h suggests a real implementation would have.  The switch
+   engine reads and writes apps through it, so an app is unpacked once
+   when it is brought in and packed once when it is written back, on
+   eviction or before a collection.  Without a cache every access
+   unpacks or packs the app in the heap. */
+
+static inline void unpackApp(CacheLine *c, const App *app)
+{
+  Int i;
+
+  c->tag = getAppTag(*app);
+  c->size = getAppSize(*app);
+  c->extra = isLONG(app->atom[APSIZE-1]) ? getLONGSize(app->atom[APSIZE-1])
+                                        : 0;
+  c->nf = c->tag != CASE && getAppNF(*app);
+  c->info = c->tag == CASE ? getAppLUT(*app) :
+            c->tag == PRIM ? (Int) getAppRegId(*app) : 0;
+  for (i = 0; i < c->size; i++)
+    c->atom[i] = getAppAtom(*app, i);
+}
+
+static inline App packApp(CacheLine *c)
+{
+  assert(!c->extra);                    // long apps are never rewritten
+  return mkApp(c->tag, c->size, c->nf, c->info, c->atom);
+}
+
+static inline void writeBack(Machine *m, CacheLine *c)
+{
+  if (c->dirty) {
+    m->heap[c->addr] = packApp(c);
+    m->cacheWriteBacks++;
+    c->dirty = 0;
+  }
+}
+
+/* The app at addr, in its cache line or else unpacked into local */
+
+static inline CacheLine *readApp(Machine *m, Int addr, CacheLine *local)
+{
+  CacheLine *c;
+
+  if (!m->cache) {
+    unpackApp(local, &m->heap[addr]);
+    return local;
+  }
+  c = &m->cache[addr & (m->cacheLines - 1)];
+  if (c->addr == addr) {
+    m->cacheHits++;
+    return c;
+  }
+  m->cacheMisses++;
+  writeBack(m, c);
+  c->addr = addr;
+  unpackApp(c, &m->heap[addr]);
+  return c;
+}
+
+/* Where to build a new app for addr, to be stored with storeApp() */
+
+static inline CacheLine *newApp(Machine *m, Int addr, CacheLine *local)
+{
+  CacheLine *c;
+
+  if (!m->cache) {
+    local->extra = 0;
+    return local;
+  }
+  c = &m->cache[addr & (m->cacheLines - 1)];
+  if (c->addr != addr) {
+    writeBack(m, c);
+    c->addr = addr;
+  }
+  c->dirty = 1;
+  c->extra = 0;
+  return c;
+}
+
+static inline void storeApp(Machine *m, Int addr, CacheLine *c)
+{
+  if (!m->cache) m->heap[addr] = packApp(c);
+}
+
+/* Write every dirty app back so the heap can be read directly, and
+   empty the cache if invalidate */
+
+void flushCache(Machine *m, Bool invalidate)
+{
+  Int i;
+
+  for (i = 0; i < m->cacheLines && m->cache; i++) {
+    writeBack(m, &m->cache[i]);
+    if (invalidate) m->cache[i].addr = -1;
+  }
+}
+
+/* Long apps (see red_atom.h) are written once, straight to the heap,
+   by update(), and never rewritten, so their cells after the first
+   are read from the heap whatever the cache holds */
+
+static inline Int longCells(Int extra)
+{
+  return (extra + APSIZE-1) / APSIZE;
+}
+
+/* The cells of the app at app, 1 unless it's long */
+
+static inline Int appCells(const App *app)
+{
+  return isLONG(app->atom[APSIZE-1])
+    ? 1 + longCells(getLONGSize(app->atom[APSIZE-1])) : 1;
+}
+
+/* Atom APSIZE-1 + i of the long app at app */
+
+static inline Atom longAtom(const App *app, Int i)
+{
+  return (Atom) app[1 + i/APSIZE].atom[i%APSIZE] |
+         (Atom) ((getLONGInts(app->atom[APSIZE-1]) >> i) & 1) << 32;
+}
+
+/* Unwinding */
+
+void unwind(Machine *m, Bool sh, Int addr)
+{
+  CacheLine local, *c = readApp(m, addr, &local);
+  Int i;
+
+  if (sh && !c->nf) {
+    Update u; u.saddr = m->sp; u.haddr = addr;
+    m->ustack[m->usp++] = u;
+  }
+  if (c->tag == CASE)
+      m->lstack[m->lsp++] = c->info;
+  m->sp--;
+  assert(c->size);
+  for (i = c->extra-1; i >= 0; i--) {
+    Atom a = longAtom(&m->heap[addr], i);
+    if (sh && isPTR(a)) a |= 1 << 30;
+    m->stack[m->sp++] = a;
+  }
+  for (i = c->size-1; i >= 0; i--) {
+    Atom a = c->atom[i];
+    if (sh && isPTR(a)) a |= 1 << 30;
+    m->stack[m->sp++] = a;
+  }
+}
+
+/* Updating */
+
+static inline Int arity(Atom a)
+{
+    if (isINT(a))
+        return 1;
+    else if (isCON(a))
+        return getCONArity(a) + 1;
+    else if (isFUN(a))
+        return getFUNArity(a);
+    else if (isPRI(a))
+        return getPRIArity(a);
+    else
+        error("arity(): invalid tag");
+    return 0;
+}
+
+Bool updateCheck(Machine *m, Atom top, Update utop)
+{
+  return (arity(top) > m->sp - utop.saddr);
+}
+
+/* An update is the only way an old app can come to point into the
+   nursery */
+
+void remember(Machine *m, Int addr)
+{
+  if (m->numRemembered == m->maxRemembered) {
+    m->maxRemembered = 2*m->maxRemembered + 1024;
+    m->remembered = realloc(m->remembered, sizeof(Int) * m->maxRemembered);
+    if (!m->remembered) fail(RED_ENOMEM, "out of memory growing the remembered set");
+  }
+  m->remembered[m->numRemembered++] = addr;
+}
+
+void upd(Machine *m, Atom top, Int p, Int len, Int addr)
+{
+  Int i, j;
+  CacheLine local, *c = newApp(m, addr, &local);
+
+  if (addr < m->nurseryBase) remember(m, addr);
+
+  c->tag = AP;
+  c->size = len;
+  c->nf = 1;
+  c->info = 0;
+  c->atom[0] = top;
+  for (i = 1, j = p; i < len; i++, j--) {
+    c->atom[i] = m->stack[j] = dash(1, m->stack[j]);
+  }
+  storeApp(m, addr, c);
+}
+
+/* The long app of top and the len-1 atoms from p down, written to
+   new cells at addr; returns the number of cells */
+
+static Int updLong(Machine *m, Atom top, Int p, Int len, Int addr)
+{
+  App *app = &m->heap[addr];
+  Atom atoms[APSIZE-1];
+  Int extra = len - (APSIZE-1), i, j;
+  UInt ints = 0;
+
+  atoms[0] = top;
+  for (i = 1, j = p; i < APSIZE-1; i++, j--)
+    atoms[i] = m->stack[j] = dash(1, m->stack[j]);
+  for (i = 0; i < extra; i++, j--) {
+    Atom a = m->stack[j] = dash(1, m->stack[j]);
+    app[1 + i/APSIZE].atom[i%APSIZE] = a;
+    ints |= (UInt) (a >> 32) << i;
+  }
+  for (; i % APSIZE; i++)
+    app[1 + i/APSIZE].atom[i%APSIZE] = mkINV();
+  app[0] = mkApp(AP, APSIZE-1, 1, 0, atoms);
+  app[0].atom[APSIZE-1] = mkLONG(extra, ints);
+  return 1 + longCells(extra);
+}
+
+/* The app at haddr is overwritten with the result, unless it takes
+   more than APSIZE atoms: then that goes in a long app of its own
+   (chained, past MAXAPPLEN atoms) and the app at haddr points to it */
+
+void update(Machine *m, Atom top, Int saddr, Int haddr)
+{
+    Int len = 1 + m->sp - saddr;
+    Int p = m->sp-2;
+
+    while (len >= APSIZE) {
+        Int n = len > MAXAPPLEN ? MAXAPPLEN : len;
+
+        if (n == APSIZE) {
+            upd(m, top, p, APSIZE, m->hp);
+            top = mkPTR(1, m->hp);
+            m->hp++;
+        } else {
+            Int cells = updLong(m, top, p, n, m->hp);
+            top = mkPTR(1, m->hp);
+            m->hp += cells;
+        }
+        p -= n-1; len -= n-1;
+    }
+    /* A result that ended up below the update frame (as after a
+       primitive) is written back as a single atom app */
+    if (len <= 0) len = 1;
+    upd(m, top, p, len, haddr);
+    while (m->numSqueezed > 0 &&
+           m->squeezedFrames[m->numSqueezed-1].saddr == saddr) {
+        upd(m, top, p, len, m->squeezedFrames[--m->numSqueezed].haddr);
+        m->squeezed++;
+    }
+    m->usp--;
+}
+
+/* Serial I/O
+
+   What the program prints collects in outBuf and is written out when
+   the buffer fills, before serial input is read, when run() returns,
+   on an error, and with -i at least every flushInterval seconds (checked
+   as output is produced and at each collection).  With -t, or -i 0,
+   every write goes straight out.
+
+   With -a the reducer doesn't do the I/O itself.  A writer thread
+   drains what outBuf hands over through one single-producer,
+   single-consumer ring, and a reader thread reads input ahead into
+   another, so the reducer only waits when it needs a byte that hasn't
+   arrived or the output ring is full, and only then has to flush.
+   Each side moves only its own index of a ring; a side that has to
+   wait sleeps on wake, and the other side signals it only if
+   something is sleeping.  Input read ahead is lost when the machine
+   is reset. */
+
+static Bool inReady(SerialIO *s)
+{
+  return __atomic_load_n(&s->inIndex.head, __ATOMIC_ACQUIRE) !=
+           s->inIndex.tail || __atomic_load_n(&s->eof, __ATOMIC_ACQUIRE);
+}
+
+static Bool inHalfEmpty(SerialIO *s)
+{
+  return s->inIndex.head - __atomic_load_n(&s->inIndex.tail,
+                                           __ATOMIC_ACQUIRE) <= SERIALRING/2 ||
+         __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE);
+}
+
+static Bool outData(SerialIO *s)
+{
+  return __atomic_load_n(&s->outIndex.head, __ATOMIC_ACQUIRE) !=
+           s->outIndex.tail || __atomic_load_n(&s->stop, __ATOMIC_ACQUIRE);
+}
+
+static Bool outRoom(SerialIO *s)
+{
+  return s->outIndex.head -
+           __atomic_load_n(&s->outIndex.tail, __ATOMIC_ACQUIRE) < SERIALRING;
+}
+
+static Bool outDrained(SerialIO *s)
+{
+  return __atomic_load_n(&s->outIndex.tail, __ATOMIC_ACQUIRE) ==
+           s->outIndex.head;
+}
+
+/* Sleep until ready(s).  The count of sleepers is raised before ready
+   is checked again and read after every move of an index, so either
+   the sleeper sees the move or the mover sees the sleeper. */
+
+static void serialWait(SerialIO *s, Bool (*ready)(SerialIO *))
+{
+  if (ready(s)) return;
+  pthread_mutex_lock(&s->lock);
+  __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+  while (!ready(s))
+    pthread_cond_wait(&s->wake, &s->lock);
+  __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void serialWake(SerialIO *s)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
+
+/* The reader takes whatever read() has (getc() for a stream without a
+   file descriptor) and, once the ring is full, waits for it to be half
+   empty.  Only the read may be cancelled, when the machine is
+   released. */
+
+static void *serialReader(void *arg)
+{
+  Machine *m = arg;
+  SerialIO *s = m->serial;
+  int fd = fileno(m->in), c, old;
+  UInt head = 0, at, n;
+  ssize_t got;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+  for (;;) {
+    if (head - __atomic_load_n(&s->inIndex.tail, __ATOMIC_ACQUIRE) ==
+        SERIALRING)
+      serialWait(s, inHalfEmpty);
+    if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) break;
+    at = head & (SERIALRING-1);
+    n = SERIALRING - (head - __atomic_load_n(&s->inIndex.tail,
+                                             __ATOMIC_ACQUIRE));
+    if (n > SERIALRING - at) n = SERIALRING - at;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+    if (fd >= 0)
+      got = read(fd, s->in + at, n);
+    else if ((c = getc(m->in)) != EOF) {
+      s->in[at] = c;
+      got = 1;
+    }
+    else
+      got = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) {
+      __atomic_store_n(&s->eof, 1, __ATOMIC_RELEASE);
+      serialWake(s);
+      break;
+    }
+    head += got;
+    __atomic_store_n(&s->inIndex.head, head, __ATOMIC_RELEASE);
+    serialWake(s);
+  }
+  return NULL;
+}
+
+/* The stream is flushed whenever the ring runs dry, before the tail
+   moves, so a drained ring means everything has been written */
+
+static void *serialWriter(void *arg)
+{
+  Machine *m = arg;
+  SerialIO *s = m->serial;
+  UInt tail = 0, head, n;
+
+  for (;;) {
+    serialWait(s, outData);
+    head = __atomic_load_n(&s->outIndex.head, __ATOMIC_ACQUIRE);
+    if (head == tail) break;            // stopped, with nothing left
+    n = head - tail;
+    if (n > SERIALRING - (tail & (SERIALRING-1)))
+      n = SERIALRING - (tail & (SERIALRING-1));
+    fwrite(s->out + (tail & (SERIALRING-1)), 1, n, m->out);
+    if (tail + n == __atomic_load_n(&s->outIndex.head, __ATOMIC_ACQUIRE))
+      fflush(m->out);
+    tail += n;
+    __atomic_store_n(&s->outIndex.tail, tail, __ATOMIC_RELEASE);
+    serialWake(s);
+  }
+  fflush(m->out);
+  return NULL;
+}
+
+void stopSerial(Machine *m)
+{
+  SerialIO *s = m->serial;
+
+  if (!s) return;
+  __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&s->lock);
+  pthread_cond_broadcast(&s->wake);
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(s->writer, NULL);
+  if (s->hasReader) {
+    pthread_cancel(s->reader);
+    pthread_join(s->reader, NULL);
+  }
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->wake);
+  free(s);
+  m->serial = NULL;
+}
+
+void startSerial(Machine *m)
+{
+  SerialIO *s = calloc(1, sizeof(SerialIO));
+
+  stopSerial(m);
+  if (!s) fail(RED_ENOMEM, "out of memory for serial I/O");
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->wake, NULL);
+  m->serial = s;
+  if (pthread_create(&s->writer, NULL, serialWriter, m) != 0) {
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+    free(s);
+    m->serial = NULL;
+    fail(RED_ENOMEM, "couldn't start the serial writer");
+  }
+  s->hasReader = m->in &&
+                 pthread_create(&s->reader, NULL, serialReader, m) == 0;
+  if (m->in && !s->hasReader) {
+    stopSerial(m);
+    fail(RED_ENOMEM, "couldn't start the serial reader");
+  }
+}
+
+/* Hand what is in outBuf on, to the stream or to the writer thread */
+
+void flushOutput(Machine *m)
+{
+  SerialIO *s = m->serial;
+  UInt head, n, at;
+  Int i;
+
+  if (s) {
+    for (i = 0; i < m->outLen; i += n) {
+      serialWait(s, outRoom);
+      head = s->outIndex.head;
+      at = head & (SERIALRING-1);
+      n = SERIALRING - (head - __atomic_load_n(&s->outIndex.tail,
+                                               __ATOMIC_ACQUIRE));
+      if (n > m->outLen - i) n = m->outLen - i;
+      if (n > SERIALRING - at) n = SERIALRING - at;
+      memcpy(s->out + at, m->outBuf + i, n);
+      __atomic_store_n(&s->outIndex.head, head + n, __ATOMIC_RELEASE);
+      serialWake(s);
+    }
+  }
+  else {
+    if (m->outLen)
+      fwrite(m->outBuf, 1, m->outLen, m->out);
+    fflush(m->out);
+  }
+  m->outLen = 0;
+  if (m->flushInterval > 0) m->lastFlush = now();
+}
+
+/* Flush and wait until the output has been written, before anything
+   else writes to the stream */
+
+void syncOutput(Machine *m)
+{
+  flushOutput(m);
+  if (m->serial) serialWait(m->serial, outDrained);
+}
+
+static Int serialGetc(Machine *m)
+{
+  SerialIO *s = m->serial;
+  UInt head, tail;
+  Int c;
+
+  if (!s) return m->in ? getc(m->in) : EOF;
+  if (!s->hasReader) return EOF;
+  if (!inReady(s)) {
+    flushOutput(m);                     // the prompt before the answer
+    serialWait(s, inReady);
+  }
+  head = __atomic_load_n(&s->inIndex.head, __ATOMIC_ACQUIRE);
+  tail = s->inIndex.tail;
+  if (tail == head) return EOF;
+  c = s->in[tail & (SERIALRING-1)];
+  __atomic_store_n(&s->inIndex.tail, tail + 1, __ATOMIC_RELEASE);
+  if (head - (tail + 1) == SERIALRING/2)  // what a full reader waits for
+    serialWake(s);
+  return c;
+}
+
+static inline void flushIfDue(Machine *m)
+{
+  if (m->flushInterval > 0 && m->outLen &&
+      now() - m->lastFlush >= m->flushInterval)
+    flushOutput(m);
+}
+
+static inline void emitted(Machine *m)
+{
+  if (m->tracingEnabled || m->flushInterval == 0)
+    flushOutput(m);
+  else
+    flushIfDue(m);
+}
+
+static inline void emitChar(Machine *m, Int c)
+{
+  if (m->outLen == OUTBUFSIZE) flushOutput(m);
+  m->outBuf[m->outLen++] = c;
+  emitted(m);
+}
+
+static inline void emitInt(Machine *m, Int n)
+{
+  char digits[12], *p = digits + sizeof digits;
+  UInt u = n < 0 ? -(UInt) n : (UInt) n;
+
+  do *--p = '0' + u % 10; while (u /= 10);
+  if (n < 0) *--p = '-';
+  if (m->outLen > OUTBUFSIZE - (Int) sizeof digits) flushOutput(m);
+  memcpy(m->outBuf + m->outLen, p, digits + sizeof digits - p);
+  m->outLen += digits + sizeof digits - p;
+  emitted(m);
+}
+
+/* Memory-mapped devices
+
+   ld32 and st32 address a space of 32-bit words.  The serial port is
+   at address 0, and -m maps more devices:
+
+     ram:BASE:WORDS         zeroed RAM
+     file:BASE:PATH         the contents of PATH as native-endian words,
+                            mapped copy-on-write
+     ring:BASE:NAME[:WORDS] a pair of rings of WORDS (default 4096, a
+                            power of two) words in the POSIX shared
+                            memory object NAME, for another process
+
+   A ring device is two words: loading BASE takes the next word sent to
+   the machine, waiting for one if need be, and storing to BASE sends
+   a word, waiting for room; loading BASE+1 gives the number of words
+   waiting.  The object is laid out as a SharedRing, created by
+   whichever side comes first and set up by the machine, magic last;
+   heads and tails count words for ever and only the producer moves a
+   head, the consumer a tail.
+
+   Devices are opened afresh for every run.  Loads from unmapped
+   addresses give 666 and stores to them are ignored. */
+
+#define RINGMAGIC 0x474e4952            // "RING"
+#define DEFRINGWORDS 4096
+
+Int parseSize(const char *s, const char *what, Int min, Int max);
+
+void closeDevices(Machine *m)
+{
+  Int i;
+
+  for (i = 0; i < m->numDevices; i++) {
+    Device *d = &m->devices[i];
+    if (d->type == DEV_RAM) free(d->mem);
+    else if (d->type == DEV_FILE) munmap(d->mem, d->mapSize);
+    else if (d->type == DEV_RING) munmap(d->ring, d->mapSize);
+  }
+  m->numDevices = 0;
+  m->lastDevice = NULL;
+}
+
+static void mapRing(Device *d, const char *spec, const char *name, UInt words)
+{
+  struct stat st;
+  char path[NAMELEN+1];
+  size_t size = sizeof(SharedRing) + sizeof(uint32_t) * 2 * (size_t) words;
+  Int fd;
+
+  snprintf(path, sizeof path, "%s%s", name[0] == '/' ? "" : "/", name);
+  fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) fail(RED_EIO, "%s: %s", spec, strerror(errno));
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size == 0 && ftruncate(fd, size) < 0)) {
+    close(fd);
+    fail(RED_EIO, "%s: %s", spec, strerror(errno));
+  }
+  if (st.st_size != 0 && st.st_size != size) {
+    close(fd);
+    fail(RED_EINVALID, "%s: shared memory of another size", spec);
+  }
+  d->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (d->ring == MAP_FAILED) fail(RED_EIO, "%s: %s", spec, strerror(errno));
+  d->mapSize = size;
+  if (d->ring->magic != RINGMAGIC) {
+    d->ring->words = words;
+    __atomic_store_n(&d->ring->magic, RINGMAGIC, __ATOMIC_RELEASE);
+  }
+  else if (d->ring->words != words)
+    fail(RED_EINVALID, "%s: rings of %u words", spec, d->ring->words);
+}
+
+static void openDevice(Machine *m, const char *spec)
+{
+  const char *colon = strchr(spec, ':'), *arg;
+  Device *d = &m->devices[m->numDevices];
+  char *end;
+  unsigned long base;
+  Int i;
+
+  if (!colon) error("bad device %s (type:base:...)", spec);
+  base = strtoul(colon+1, &end, 0);
+  if (end == colon+1 || *end != ':' || base > UINT32_MAX)
+    error("bad base address in device %s", spec);
+  arg = end+1;
+  memset(d, 0, sizeof *d);
+  d->base = base;
+
+  if (strncmp(spec, "ram:", 4) == 0) {
+    d->size = parseSize(arg, "RAM", 1, 1 << 28);
+    if (!(d->mem = calloc(d->size, sizeof(uint32_t))))
+      fail(RED_ENOMEM, "out of memory for %s", spec);
+    d->type = DEV_RAM;
+  }
+  else if (strncmp(spec, "file:", 5) == 0) {
+    struct stat st;
+    Int fd = open(arg, O_RDONLY);
+
+    if (fd < 0) fail(RED_EIO, "%s: %s", arg, strerror(errno));
+    if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+        st.st_size > (off_t) sizeof(uint32_t) << 28) {
+      close(fd);
+      fail(RED_EIO, "%s: empty, too big or unreadable", arg);
+    }
+    d->mapSize = st.st_size;
+    d->size = (st.st_size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+    d->mem = mmap(NULL, d->mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                  fd, 0);
+    close(fd);
+    if (d->mem == MAP_FAILED)
+      fail(RED_EIO, "couldn't map %s: %s", arg, strerror(errno));
+    d->type = DEV_FILE;
+  }
+  else if (strncmp(spec, "ring:", 5) == 0) {
+    char name[NAMELEN];
+    const char *sep = strchr(arg, ':');
+    UInt words = DEFRINGWORDS;
+
+    if (sep) words = parseSize(sep+1, "ring", 1, 1 << 24);
+    if (words & (words - 1))
+      error("ring of %u words isn't a power of two", words);
+    snprintf(name, sizeof name, "%.*s", sep ? (int) (sep - arg) : NAMELEN, arg);
+    mapRing(d, spec, name, words);
+    d->size = 2;
+    d->type = DEV_RING;
+  }
+  else
+    error("unknown device type in %s (ram, file or ring)", spec);
+  m->numDevices++;
+
+  if (d->base + (uint64_t) d->size > (uint64_t) UINT32_MAX + 1)
+    error("device %s runs off the end of the address space", spec);
+  for (i = 0; i < m->numDevices-1; i++) {
+    const Device *o = &m->devices[i];
+    if (d->base < o->base + (uint64_t) o->size &&
+        o->base < d->base + (uint64_t) d->size)
+      error("device %s overlaps another", spec);
+  }
+}
+
+void openDevices(Machine *m)
+{
+  Int i;
+
+  closeDevices(m);
+  memset(&m->devices[0], 0, sizeof(Device));
+  m->devices[0].type = DEV_SERIAL;
+  m->devices[0].size = 1;
+  m->numDevices = 1;
+  for (i = 0; i < m->numDeviceSpecs; i++)
+    openDevice(m, m->deviceSpecs[i]);
+}
+
+/* The device at addr, if any; the last one found is tried first */
+
+static inline Device *findDevice(Machine *m, UInt addr)
+{
+  Device *d = m->lastDevice;
+  Int i;
+
+  if (d && addr - d->base < d->size) return d;
+  for (i = 0; i < m->numDevices; i++)
+    if (addr - m->devices[i].base < m->devices[i].size)
+      return m->lastDevice = &m->devices[i];
+  return NULL;
+}
+
+static void ringWait(void)
+{
+  struct timespec ts = { 0, 20000 };
+
+  nanosleep(&ts, NULL);
+}
+
+static Int ringLoad(Device *d, UInt offset)
+{
+  SharedRing *r = d->ring;
+  uint32_t tail = r->in.tail, value;
+
+  if (offset == 1)
+    return __atomic_load_n(&r->in.head, __ATOMIC_ACQUIRE) - tail;
+  while (__atomic_load_n(&r->in.head, __ATOMIC_ACQUIRE) == tail)
+    ringWait();
+  value = r->data[tail & (r->words-1)];
+  __atomic_store_n(&r->in.tail, tail+1, __ATOMIC_RELEASE);
+  return value;
+}
+
+static void ringStore(Device *d, UInt offset, Int value)
+{
+  SharedRing *r = d->ring;
+  uint32_t head = r->out.head;
+
+  if (offset != 0) return;
+  while (head - __atomic_load_n(&r->out.tail, __ATOMIC_ACQUIRE) == r->words)
+    ringWait();
+  r->data[r->words + (head & (r->words-1))] = value;
+  __atomic_store_n(&r->out.head, head+1, __ATOMIC_RELEASE);
+}
+
+/* Primitive reduction */
+
+Atom prim_ld32(Machine *m, Int addr)
+{
+    Device *d = findDevice(m, addr);
+    Atom res = mkINT(666);
+
+    if (d)
+        switch (d->type) {
+        case DEV_SERIAL:
+            if (!m->serial)
+                flushOutput(m);         // the prompt before the answer
+            res = mkINT(serialGetc(m));
+            break;
+        case DEV_RAM:
+        case DEV_FILE:
+            res = mkINT(d->mem[(UInt) addr - d->base]);
+            break;
+        case DEV_RING:
+            res = mkINT(ringLoad(d, (UInt) addr - d->base));
+            break;
+        }
+
+    if (m->tracingEnabled) {
+        fprintf(m->out, "[[ld32 (%d) -> %d]]", addr, getINTValue(res));
+        fflush(m->out);
+    }
+
+    /* This is a hack to terminate otherwise infinite processes */
+    if (d && d->type == DEV_SERIAL && getINTValue(res) < 0)
+        longjmp(m->halt, 1);
+
+    return res;
+}
+
+Atom prim_st32(Machine *m, Int addr, Int value, Atom k)
+{
+    Device *d = findDevice(m, addr);
+
+    if (d)
+        switch (d->type) {
+        case DEV_SERIAL:
+            emitChar(m, value);
+            break;
+        case DEV_RAM:
+        case DEV_FILE:
+            d->mem[(UInt) addr - d->base] = value;
+            break;
+        case DEV_RING:
+            ringStore(d, (UInt) addr - d->base, value);
+            break;
+        }
+
+    if (m->tracingEnabled) {
+        fprintf(m->out, "[[st32 (%d)=%d]]", addr, value);
+        fflush(m->out);
+    }
+
+    return k;
+}
+
+/* Primitives that fail on some operands aren't speculated: the
+   application may never be demanded */
+
+static inline Bool primFails(Prim p, Atom b)
+{
+  return ((p == QUOT || p == REM) && getINTValue(b) == 0)
+      || ((p == SHL || p == SHR) && getINTValue(b) < 0);
+}
+
+Atom prim(Machine *m, Prim p, Atom a, Atom b, Atom c)
+{
+  Atom result = 0;
+  Int n, k;
+  n = getINTValue(a);
+  k = getINTValue(b);
+  switch (p) {
+    case ADD: result = mkINT(n+k); break;
+    case SUB: result = mkINT(n-k); break;
+    case EQ: result = n == k ? trueAtom : falseAtom; break;
+    case NEQ: result = n != k ? trueAtom : falseAtom; break;
+    case LEQ: result = n <= k ? trueAtom : falseAtom; break;
+    case EMIT: emitChar(m, n); result = b; break;
+    case EMITINT: emitInt(m, n); result = b; break;
+    case AND: result = mkINT(n & k); break;
+    case ST32: result = prim_st32(m, n, k, c); break;
+    case LD32: result = prim_ld32(m, n); break;
+    case MUL: result = mkINT((UInt) n * (UInt) k); break;
+    case QUOT:
+    case REM:
+      if (k == 0)
+          error("division by zero in %d %s %d", n, p == QUOT ? "/" : "%", k);
+      if (k == -1)                  // INT_MIN / -1 wraps, as in hardware
+          result = mkINT(p == QUOT ? (Int) -(UInt) n : 0);
+      else
+          result = mkINT(p == QUOT ? n / k : n % k);
+      break;
+    case OR: result = mkINT(n | k); break;
+    case XOR: result = mkINT(n ^ k); break;
+    case SHL:
+    case SHR:
+      if (k < 0)
+          error("negative shift in %d %s %d", n, p == SHL ? ".<<." : ".>>.", k);
+      if (p == SHL)
+          result = mkINT(k < 32 ? (UInt) n << k : 0);
+      else
+          result = mkINT(n >> (k < 32 ? k : 31));
+      break;
+    default: assert(0);
+  }
+
+  return result;
+}
+
+void applyPrim(Machine *m)
+{
+  Atom p = m->stack[m->sp-2];
+  Prim pid = getPRIId(p);
+  if (pid == SEQ) {
+    m->stack[m->sp-2] = m->stack[m->sp-3];
+    m->stack[m->sp-3] = m->stack[m->sp-1];
+    m->sp-=1;
+    m->primCount++;
+  }
+  else if (isINT(m->stack[m->sp-3])
+        || pid == EMIT || pid == EMITINT) {
+    if (getPRISwap(p))
+        m->stack[m->sp-3] = prim(m, pid, m->stack[m->sp-3], m->stack[m->sp-1], m->stack[4 <= m->sp ? m->sp-4 : 0]);
+    else
+        m->stack[m->sp-3] = prim(m, pid, m->stack[m->sp-1], m->stack[m->sp-3], m->stack[4 <= m->sp ? m->sp-4 : 0]);
+    m->sp -= getPRIArity(p);
+    m->primCount++;
+  }
+  else {
+      Atom tmp;
+      m->stack[m->sp-2] = togglePRISwap(m->stack[m->sp-2]);
+      tmp = m->stack[m->sp-1];
+      m->stack[m->sp-1] = m->stack[m->sp-3];
+      m->stack[m->sp-3] = tmp;
+      m->swapCount++;
+  }
+}
+
+/* Case-alt selection */
+
+void caseSelect(Machine *m, Int index)
+{
+  Int lut = m->lstack[m->lsp-1];
+  m->stack[m->sp-1] = mkFUN(1,0,lut+index);
+  m->lsp--;
+}
+
+/* Function application */
+
+Atom inst(Machine *m, Int base, Int argPtr, Atom a)
+{
+    if (isPTR(a)) {
+        a = mkPTR(getPTRShared(a), base + getPTRId(a));
+  }
+  else if (isARG(a)) {
+      a = dash(getARGShared(a), m->stack[argPtr - getARGIndex(a)]);
+  }
+  else if (isREG(a)) {
+      a = dash(getREGShared(a), m->registers[getREGIndex(a)]);
+  }
+  return a;
+}
+
+Atom getPrimArg(Machine *m, Int argPtr, Atom a)
+{
+    if (isARG(a)) return m->stack[argPtr - getARGIndex(a)];
+    else if (isREG(a)) return m->registers[getREGIndex(a)];
+  else return a;
+}
+
+void instApp(Machine *m, Int base, Int argPtr, const App *app)
+{
+  Int i;
+  Atom a, b;
+  CacheLine local, *new;
+  Int rid;
+
+  if (getAppTag(*app) == PRIM) {
+    m->prsCandidateCount++;
+    a = getAppAtom(*app, 0);
+    b = getAppAtom(*app, 2);
+    a = getPrimArg(m, argPtr, a);
+    b = getPrimArg(m, argPtr, b);
+    rid = getAppRegId(*app);
+    if (isINT(a) && isINT(b) && !primFails(getPRIId(getAppAtom(*app, 1)), b)) {
+      m->prsSuccessCount++;
+      m->registers[rid] = prim(m, getPRIId(getAppAtom(*app, 1)), a, b, b);
+    }
+    else {
+      m->registers[rid] = mkPTR(0, m->hp);
+
+      new = newApp(m, m->hp, &local);
+      new->tag = AP;
+      new->size = getAppSize(*app);
+      new->nf = 0;
+      new->info = 0;
+      for (i = 0; i < new->size; i++)
+          new->atom[i] = inst(m, base, argPtr, getAppAtom(*app, i));
+      storeApp(m, m->hp, new);
+
+      m->hp++;
+    }
+  }
+  else {
+    new = newApp(m, m->hp, &local);
+    new->tag = getAppTag(*app);
+    new->size = getAppSize(*app);
+    new->nf = new->tag != CASE && getAppNF(*app);
+    new->info = new->tag == CASE ? getAppLUT(*app) : 0;
+    for (i = 0; i < new->size; i++)
+        new->atom[i] = inst(m, base, argPtr, getAppAtom(*app, i));
+    storeApp(m, m->hp, new);
+
+    m->hp++;
+  }
+}
+
+void slide(Machine *m, Int p, Int n)
+{
+  Int i;
+  for (i = p; i < m->sp; i++) m->stack[i-n] = m->stack[i];
+  m->sp -= n;
+}
+
+void apply(Machine *m, const Template* t)
+{
+  Int i;
+  Int base = m->hp;
+  Int spOld = m->sp;
+
+  for (i = t->numLuts-1; i >= 0; i--) m->lstack[m->lsp++] = t->luts[i];
+  for (i = 0; i < t->numApps; i++)
+    instApp(m, base, spOld-2, &(t->apps[i]));
+  for (i = t->numPushs-1; i >= 0; i--)
+    m->stack[m->sp++] = inst(m, base, spOld-2, t->pushs[i]);
+
+  slide(m, spOld, t->arity+1);
+}
+
+/* Garbage collection */
+
+Bool isSimple(App *app)
+{
+    return (getAppSize(*app) == 1 && getAppTag(*app) != CASE &&
+            (isINT(getAppAtom(*app, 0)) || isCON(getAppAtom(*app, 0))));
+}
+
+Atom copyChild(Machine *m, Atom child)
+{
+  App app;
+  if (isPTR(child) && getPTRId(child) >= m->gcFrom) {
+    app = m->heap[getPTRId(child)];
+    if (isAppCollected(app))
+        return getAppCollectedAtom(app);
+    else if (isSimple(&app))
+        return getAppAtom(app, 0);
+    else {
+      Int addr = getPTRId(child), n = appCells(&app);
+      child = setPTRId(child, m->gcHigh);
+      memcpy(&m->toSpace[m->gcHigh], &m->heap[addr], sizeof(App) * n);
+      m->heap[addr] = mkAppCollected(child);
+      m->gcHigh += n;
+      return child;
+    }
+  }
+  return child;
+}
+
+App copyChildren(Machine *m, App app)
+{
+  Int i;
+  Atom atoms[APSIZE];
+  for (i = 0; i < getAppSize(app); i++)
+      atoms[i] = copyChild(m, getAppAtom(app, i));
+  return mkApp(getAppTag(app), getAppSize(app), getAppNF(app),
+               getAppLUT(app), atoms);
+}
+
+/* copyChildren() of the app at cells and of the rest of its atoms if
+   it's long, whose INT flags are redone as children may have been
+   inlined; returns the number of cells */
+
+Int copyApp(Machine *m, App *cells)
+{
+  Atom last = cells->atom[APSIZE-1];
+  Int extra, i;
+  UInt ints = 0;
+
+  *cells = copyChildren(m, *cells);
+  if (!isLONG(last)) return 1;
+  cells->atom[APSIZE-1] = last;
+  extra = getLONGSize(last);
+  for (i = 0; i < extra; i++) {
+    Atom a = copyChild(m, longAtom(cells, i));
+    cells[1 + i/APSIZE].atom[i%APSIZE] = a;
+    ints |= (UInt) (a >> 32) << i;
+  }
+  cells->atom[APSIZE-1] = mkLONG(extra, ints);
+  return 1 + longCells(extra);
+}
+
+void copy(Machine *m)
+{
+  while (m->gcLow < m->gcHigh) {
+      if (m->census) censusApp(m->census, m->toSpace[m->gcLow]);
+      m->gcLow += copyApp(m, &m->toSpace[m->gcLow]);
+  }
+}
+
+/* The update stack after copying: frames whose app died are dropped,
+   the rest follow their app to its new address */
+
+void updateUStack(Machine *m)
+{
+  Int i, j;
+  App app;
+  for (i = 0, j = 0; i < m->usp; i++) {
+    app = m->heap[m->ustack[i].haddr];
+    if (m->ustack[i].haddr < m->gcFrom)
+      m->ustack[j++] = m->ustack[i];
+    else if (isAppCollected(app)) {
+      m->ustack[j] = m->ustack[i];
+      m->ustack[j].haddr = getPTRId(getAppCollectedAtom(app));
+      j++;
+    }
+  }
+  m->usp = j;
+}
+
+void stackOverflow(Machine *m, const char *);
+
+/* With -q the walk after copying also squeezes the update stack.
+   Frames with the same stack address are updated with the same value
+   one after the other, so all but the top one of such a run are moved
+   to squeezedFrames, and update() gives their apps that value when it
+   updates the frame left (saving the updates the rest would take).
+   Squeezed frames stay weak references: they are fixed up or dropped
+   along with the others, and if the frame left at an address dies,
+   the top squeezed frame there takes its place. */
+
+static Bool liveFrame(Machine *m, Update *f)
+{
+  App app;
+
+  if (f->haddr < m->gcFrom) return 1;
+  app = m->heap[f->haddr];
+  if (!isAppCollected(app)) return 0;
+  f->haddr = getPTRId(getAppCollectedAtom(app));
+  return 1;
+}
+
+void squeezeUStack(Machine *m)
+{
+  Int i, j, k, n, need = m->numSqueezed + m->usp;
+  Update *out;
+
+  if (need > m->maxSqueezed) {
+    m->maxSqueezed = 2*need;
+    m->squeezedFrames = realloc(m->squeezedFrames,
+                                sizeof(Update) * m->maxSqueezed);
+    m->squeezedFrames2 = realloc(m->squeezedFrames2,
+                                 sizeof(Update) * m->maxSqueezed);
+    if (!m->squeezedFrames || !m->squeezedFrames2)
+      fail(RED_ENOMEM, "out of memory squeezing the update stack");
+  }
+  out = m->squeezedFrames2;
+  for (i = j = k = n = 0; i < m->usp; i++) {
+    Update f = m->ustack[i];
+    Bool live = liveFrame(m, &f);
+
+    for (; k < m->numSqueezed && m->squeezedFrames[k].saddr <= f.saddr; k++) {
+      Update g = m->squeezedFrames[k];
+      if (liveFrame(m, &g)) out[n++] = g;
+    }
+    if (!live) {
+      if (n == 0 || out[n-1].saddr != f.saddr) continue;
+      f = out[--n];
+    }
+    if (i+1 < m->usp && m->ustack[i+1].saddr == f.saddr)
+      out[n++] = f;
+    else
+      m->ustack[j++] = f;
+  }
+  assert(k == m->numSqueezed);
+  m->squeezedFrames2 = m->squeezedFrames;
+  m->squeezedFrames = out;
+  m->numSqueezed = n;
+  m->usp = j;
+}
+
+/* Put the squeezed frames back on the update stack, for a snapshot or
+   residual program that has no place for them */
+
+void unsqueezeUStack(Machine *m)
+{
+  Int i = m->usp-1, k = m->numSqueezed-1, j = m->usp + m->numSqueezed;
+
+  if (j > m->maxUStackElems) stackOverflow(m, "update stack");
+  m->usp = j;
+  while (k >= 0) {
+    if (i >= 0 && m->ustack[i].saddr >= m->squeezedFrames[k].saddr)
+      m->ustack[--j] = m->ustack[i--];
+    else
+      m->ustack[--j] = m->squeezedFrames[k--];
+  }
+  m->numSqueezed = 0;
+}
+
+/* The heap arrays are malloc()ed, except for one restored from a
+   snapshot, which lives in the snapshot's mapping (see below) */
+
+void freeHeapArray(Machine *m, App *heap)
+{
+  if (heap == m->mappedHeap)
+    m->mappedHeap = NULL;
+  else
+    free(heap);
+}
+
+/* Grow the heap (and to-space) if the last collection left the live
+   apps filling more than half of the space left after reserve; live
+   data doesn't move, so only the arrays are resized */
+
+void growHeap(Machine *m, Int live, Int reserve)
+{
+  Int newSize = m->maxHeapApps;
+
+  while (live > (newSize - reserve)/2 && newSize < m->heapLimit)
+    newSize *= 2;
+  if (newSize > m->heapLimit) newSize = m->heapLimit;
+  if (newSize == m->maxHeapApps) return;
+
+  if (m->heap == m->mappedHeap) {
+    App *heap = (App*) malloc(sizeof(App) * newSize);
+    if (heap) memcpy(heap, m->heap, sizeof(App) * m->maxHeapApps);
+    m->heap = heap;
+    m->mappedHeap = NULL;
+  }
+  else
+    m->heap = (App*) realloc(m->heap, sizeof(App) * newSize);
+  freeHeapArray(m, m->heap2);
+  m->heap2 = (App*) malloc(sizeof(App) * newSize);
+  if (!m->heap || !m->heap2) fail(RED_ENOMEM, "failed to grow heap to %d apps", newSize);
+  m->maxHeapApps = newSize;
+}
+
+/* Copy everything live to the bottom of heap2 and swap */
+
+void majorCollect(Machine *m)
+{
+  Int i;
+  App* tmp;
+  double start = now();
+  m->majorCount++;
+  m->gcFrom = 0;
+  m->toSpace = m->heap2;
+  m->gcLow = m->gcHigh = 0;
+  for (i = 0; i < m->sp; i++) m->stack[i] = copyChild(m, m->stack[i]);
+  copy(m);
+  if (m->squeeze) squeezeUStack(m); else updateUStack(m);
+  tmp = m->heap; m->heap = m->heap2; m->heap2 = tmp;
+  m->majorCopied += (Long) m->gcHigh * sizeof(App);
+  if (m->census) censusRow(m, 1);
+  m->majorTime += now() - start;
+}
+
+/* Promote everything live in the nursery to the top of the old
+   generation, with the remembered apps as extra roots */
+
+void minorCollect(Machine *m)
+{
+  Int i;
+  double start = now();
+  m->minorCount++;
+  m->gcFrom = m->nurseryBase;
+  m->toSpace = m->heap;
+  m->gcLow = m->gcHigh = m->oldTop;
+  for (i = 0; i < m->sp; i++) m->stack[i] = copyChild(m, m->stack[i]);
+  for (i = 0; i < m->numRemembered; i++)
+    copyApp(m, &m->heap[m->remembered[i]]);
+  m->numRemembered = 0;
+  copy(m);
+  if (m->squeeze) squeezeUStack(m); else updateUStack(m);
+  m->minorCopied += (Long) (m->gcHigh - m->oldTop) * sizeof(App);
+  if (m->census) censusRow(m, 0);
+  m->oldTop = m->gcHigh;
+  m->minorTime += now() - start;
+}
+
+void collectGenerations(Machine *m)
+{
+  if (!m->nurseryApps) {
+    majorCollect(m);
+    m->hp = m->gcHigh;
+    //printf("After GC: %i\n", hp);
+    if (m->hp > m->maxHeapApps/2) growHeap(m, m->hp, 0);
+    if (m->hp > m->maxHeapApps-HEAPMARGIN) stackOverflow(m, "heap");
+    return;
+  }
+
+  /* The old generation must always have room for a full nursery */
+  minorCollect(m);
+  if (m->oldTop + m->nurseryApps > m->nurseryBase) {
+    majorCollect(m);
+    m->oldTop = m->gcHigh;
+    if (m->oldTop > (m->maxHeapApps - m->nurseryApps)/2)
+      growHeap(m, m->oldTop, m->nurseryApps);
+    m->nurseryBase = m->maxHeapApps - m->nurseryApps;
+    if (m->oldTop + m->nurseryApps > m->nurseryBase) stackOverflow(m, "heap");
+  }
+  m->hp = m->nurseryBase;
+}
+
+void collect(Machine *m)
+{
+  Long minorCopied = m->minorCopied, majorCopied = m->majorCopied;
+  Long survivors, c = cycles();
+  double start = now(), pause;
+  Int majorCount = m->majorCount, live;
+
+  m->gcCount++;
+  flushCache(m, 1);
+  collectGenerations(m);
+  live = m->nurseryApps ? m->oldTop : m->hp;
+  if (live > m->maxLive) m->maxLive = live;
+  /* A major collection after a minor one copies what the minor one
+     promoted again, so only the last copy counts */
+  survivors = (m->majorCount != majorCount ? m->majorCopied - majorCopied
+               : m->minorCopied - minorCopied) / sizeof(App);
+  if (m->prof) m->prof->nodes[m->prof->cur].survivors += survivors;
+
+  pause = now() - start;
+  m->gcTime += pause;
+  flushIfDue(m);
+  m->gcCycles += cycles() - c;
+  m->pauseHist[histBucket(pause * 1e6)]++;
+  m->survivorHist[histBucket(survivors)]++;
+}
+
+/* Allocate memory */
+
+Bool dispatch(Machine *m);
+Bool dispatchProfiled(Machine *m);
+
+void alloc(Machine *m)
+{
+  m->heap = (App*) malloc(sizeof(App) * m->maxHeapApps);
+  m->heap2 = (App*) malloc(sizeof(App) * m->maxHeapApps);
+  m->stack = (Atom*) malloc(sizeof(Atom) * m->maxStackElems);
+  m->ustack = (Update*) malloc(sizeof(Update) * m->maxUStackElems);
+  m->lstack = (Lut*) malloc(sizeof(Lut) * m->maxLStackElems);
+  m->registers = (Atom*) malloc(sizeof(Atom) * MAXREGS);
+  m->profTable = (ProfEntry*) malloc(sizeof(ProfEntry) * MAXTEMPLATES);
+  /* Only the switch engine goes through the cache */
+  if (m->engine != dispatch)
+    m->cacheLines = 0;
+  m->cache = NULL;
+  if (m->cacheLines)
+    m->cache = (CacheLine*) malloc(sizeof(CacheLine) * m->cacheLines);
+  if (!m->heap || !m->heap2 || !m->stack || !m->ustack || !m->lstack ||
+      !m->registers || !m->profTable || (m->cacheLines && !m->cache))
+    fail(RED_ENOMEM, "out of memory allocating the machine");
+}
+
+void freeDecoded(Machine *m);
+void freeJit(Machine *m);
+
+void release(Machine *m)
+{
+  freeHeapArray(m, m->heap);
+  freeHeapArray(m, m->heap2);
+  free(m->stack);
+  free(m->ustack);
+  free(m->lstack);
+  free(m->registers);
+  free(m->profTable);
+  free(m->remembered);
+  free(m->squeezedFrames);
+  free(m->squeezedFrames2);
+  free(m->cache);
+  freeDecoded(m);
+  freeProfile(m);
+  freeCensus(m);
+  closeDevices(m);
+  stopSerial(m);
+}
+
+/* Initialise globals */
+
+void selectKernel(void);
+
+void initAtoms(void)
+{
+  falseAtom = mkCON(0,0);
+  trueAtom = mkCON(0,1);
+  mainAtom = mkFUN(0,0,0);
+  selectKernel();
+}
+
+void initProfTable(Machine *m)
+{
+  Int i;
+  for (i = 0; i < MAXTEMPLATES; i++) {
+    m->profTable[i].callCount = 0;
+  }
+}
+
+void init(Machine *m)
+{
+  Int i;
+
+  m->sp = 1;
+  m->usp = m->lsp = m->oldTop = m->numRemembered = m->numSqueezed = 0;
+  m->nurseryBase = m->nurseryApps ? m->maxHeapApps - m->nurseryApps : 0;
+  m->hp = m->nurseryBase;
+  m->stack[0] = mainAtom;
+  m->swapCount = m->primCount = m->applyCount =
+    m->unwindCount = m->updateCount = m->selectCount =
+      m->prsCandidateCount = m->prsSuccessCount = m->gcCount = 0;
+  m->prsSelectCount = m->prsSelectHits = 0;
+  m->minorCount = m->majorCount = m->maxLive = 0;
+  m->minorCopied = m->majorCopied = 0;
+  m->cacheHits = m->cacheMisses = m->cacheWriteBacks = 0;
+  m->squeezed = 0;
+  for (i = 0; i < m->cacheLines && m->cache; i++) {
+    m->cache[i].addr = -1;
+    m->cache[i].dirty = 0;
+  }
+  m->minorTime = m->majorTime = m->gcTime = m->runTime = 0;
+  m->status = RED_BUDGET;
+  m->outLen = 0;
+  m->lastFlush = now();
+  m->gcCycles = 0;
+  memset(m->pauseHist, 0, sizeof m->pauseHist);
+  memset(m->survivorHist, 0, sizeof m->survivorHist);
+  initProfTable(m);
+}
+
+/* Dispatch loop */
+
+Long ticks(const Machine *m)
+{
+  return m->swapCount + m->primCount + m->applyCount +
+         m->unwindCount + m->updateCount;
+}
+
+static inline Bool canCollect(Machine *m)
+{
+    return !isFUN(m->stack[m->sp-1]) || getFUNOriginal(m->stack[m->sp-1]);
+}
+
+void stackOverflow(Machine *m, const char *which)
+{
+    fail(RED_EOVERFLOW, "%s is out of space (hp = %d, sp = %d, usp = %d, lsp = %d).",
+          which, m->hp, m->sp, m->usp, m->lsp);
+}
+
+/* Superinstructions
+
+   Some steps always or mostly come in pairs (see the rule pairs of
+   -p): a case selection leaves a FUN atom that is applied next, an
+   unwind often uncovers another pointer to unwind, and an update is
+   often followed by a case selection.  dispatch() runs each pair
+   without going round its loop, making only the checks the loop would
+   have made between them, so the steps and the ticks are the same.
+   The threaded engine has the same shortcuts in its jumps. */
+
+static inline Bool roomToUnwind(const Machine *m)
+{
+  return m->sp <= m->maxStackElems-STACKMARGIN &&
+         m->usp <= m->maxUStackElems-STACKMARGIN &&
+         m->lsp <= m->maxLStackElems-STACKMARGIN;
+}
+
+/* Apply the FUN atom on top, or return 0 if out of ticks */
+
+static inline Bool applyTop(Machine *m, Atom top)
+{
+  if (ticks(m) >= m->tickLimit) return 0;
+  m->profTable[getFUNId(top)].callCount++;
+  m->applyCount++;
+  apply(m, &m->code[getFUNId(top)]);
+  return 1;
+}
+
+/* Select the alternative for the constructor on top and apply it,
+   unless the heap wants collecting first; the alternative has arity
+   0, so never fails the update check */
+
+static inline Bool selectApply(Machine *m, Atom top)
+{
+  m->selectCount++;
+  caseSelect(m, getCONIndex(top));
+  if (m->hp > m->maxHeapApps-HEAPMARGIN) return 1;
+  return applyTop(m, m->stack[m->sp-1]);
+}
+
+Bool dispatch(Machine *m)
+{
+  Atom top;
+
+  while (!(m->sp == 1 && isINT(m->stack[0]))) {
+    if (m->sp > m->maxStackElems-STACKMARGIN) stackOverflow(m, "stack");
+    if (m->usp > m->maxUStackElems-STACKMARGIN) stackOverflow(m, "update stack");
+    if (m->lsp > m->maxLStackElems-STACKMARGIN) stackOverflow(m, "case stack");
+    if (m->hp > m->maxHeapApps-HEAPMARGIN && canCollect(m)) collect(m);
+    top = m->stack[m->sp-1];
+    if (isPTR(top)) {
+      /* unwind+unwind: down the spine while it has pointers */
+      do {
+        unwind(m, getPTRShared(top), getPTRId(top));
+        m->unwindCount++;
+        top = m->stack[m->sp-1];
+      } while (isPTR(top) && roomToUnwind(m));
+    }
+    else if (m->usp > 0 && updateCheck(m, top, m->ustack[m->usp-1])) {
+      update(m, top, m->ustack[m->usp-1].saddr, m->ustack[m->usp-1].haddr);
+      m->updateCount++;
+      /* update+select(+apply) */
+      top = m->stack[m->sp-1];
+      if (isCON(top) && m->hp <= m->maxHeapApps-HEAPMARGIN &&
+          !(m->usp > 0 && updateCheck(m, top, m->ustack[m->usp-1])) &&
+          !selectApply(m, top))
+        return 0;
+    }
+    else {
+        if (isINT(top)) {
+            assert(isPRI(m->stack[m->sp-2]));
+            applyPrim(m);
+        }
+        else if (isCON(top)) {
+            /* select+apply */
+            if (!selectApply(m, top)) return 0;
+        }
+        else if (isFUN(top)) {
+            if (!applyTop(m, top)) return 0;
+        }
+        else
+            error("dispatch(): invalid tag.");
+    }
+  }
+  return 1;
+}
+
+/* Profiling engine: the rules of dispatch(), keeping the cost-centre
+   stack (see above) and charging each step to it */
+
+Bool dispatchProfiled(Machine *m)
+{
+  Profile *p = m->prof;
+  Atom top;
+  Int hp0, node, i;
+
+  while (!(m->sp == 1 && isINT(m->stack[0]))) {
+    if (m->sp > m->maxStackElems-STACKMARGIN) stackOverflow(m, "stack");
+    if (m->usp > m->maxUStackElems-STACKMARGIN) stackOverflow(m, "update stack");
+    if (m->lsp > m->maxLStackElems-STACKMARGIN) stackOverflow(m, "case stack");
+    if (m->hp > m->maxHeapApps-HEAPMARGIN && canCollect(m)) collect(m);
+    top = m->stack[m->sp-1];
+    hp0 = m->hp;
+    node = p->cur;
+    if (isPTR(top)) {
+      Int usp0 = m->usp, lsp0 = m->lsp;
+      unwind(m, getPTRShared(top), getPTRId(top));
+      m->unwindCount++;
+      countRule(p, RULE_UNWIND);
+      if (m->usp > usp0) m->ustack[usp0].ccs = node;
+      for (i = lsp0; i < m->lsp; i++) p->lccs[i] = node;
+    }
+    else if (m->usp > 0 && updateCheck(m, top, m->ustack[m->usp-1])) {
+      p->cur = m->ustack[m->usp-1].ccs;
+      update(m, top, m->ustack[m->usp-1].saddr, m->ustack[m->usp-1].haddr);
+      m->updateCount++;
+      countRule(p, RULE_UPDATE);
+    }
+    else if (isINT(top)) {
+      assert(isPRI(m->stack[m->sp-2]));
+      applyPrim(m);
+      countRule(p, RULE_PRIM);
+    }
+    else if (isCON(top)) {
+      m->selectCount++;
+      countRule(p, RULE_SELECT);
+      p->cur = p->lccs[m->lsp-1];
+      caseSelect(m, getCONIndex(top));
+      continue;                         // not a tick
+    }
+    else if (isFUN(top)) {
+      Int id = getFUNId(top), lsp0 = m->lsp;
+      if (ticks(m) >= m->tickLimit) return 0;
+      m->profTable[id].callCount++;
+      m->applyCount++;
+      countRule(p, RULE_APPLY);
+      countTemplatePair(p, id);
+      node = p->cur = enterCC(p, p->cur, p->ccOf[id]);
+      apply(m, &m->code[id]);
+      for (i = lsp0; i < m->lsp; i++) p->lccs[i] = node;
+    }
+    else
+      error("dispatch(): invalid tag.");
+    p->nodes[node].ticks++;
+    p->nodes[node].allocs += m->hp - hp0;
+  }
+  return 1;
+}
+
+/* Threaded dispatch engine
+
+   Each template is pre-decoded into a sequence of instructions, each
+   carrying the address of its handler, so applying a template is a
+   straight run of indirect jumps rather than a re-decoding of packed
+   apps.  The reduction rule for the top of stack is picked with a jump
+   table indexed by the atom tag.  Stack overflow checks are made only
+   where the stacks grow, against each template's budget on apply, and
+   the heap is checked only after the rules that allocate.  The rules,
+   their order, the points at which the heap is collected and the tick
+   accounting are exactly those of dispatch() above. */
+
+typedef enum {
+    OP_LUT,                             // push a case table
+    OP_APP,                             // instantiate a heap app
+    OP_APP_SSE2, OP_APP_AVX2,           // the same, vectorised
+    OP_PRS,                             // speculated primitive app
+    OP_PUSH, OP_PUSH_PTR,               // spine atoms
+    OP_PUSH_ARG, OP_PUSH_REG,
+    OP_SLIDE,                           // drop the redex, next step
+    OP_END,                             // spine already in place
+    OP_SELECT,                          // either, then a speculated
+                                        // comparison and case selection
+    LAST_OP } Op;
+
+/* A template app, packed as far as it can be before instantiation:
+   PTR atoms still need the heap base adding and ARG/REG atoms filling
+   in from the stack and registers */
+
+#define PTRIDMASK (~(~0U << (30 - HT)) << HT)
+
+typedef struct {
+    uint32_t atom[APSIZE];              // as mkApp(), less HT, PTR ids
+                                        // and ARG/REG atoms
+    uint32_t id[APSIZE];                // PTR offsets, shifted in place
+    uint32_t ptr[APSIZE];               // PTRIDMASK where atom is a PTR
+    UInt ht;                            // HT bits known from the template
+    Int numDyn;
+    struct { Int slot, index; Bool reg, shared; } dyn[APSIZE];
+
+    /* The ARG/REG atoms again, by lane, for the AVX2 kernel: byte
+       offsets from the argument pointer or the registers, and all ones
+       in the lanes that are ARG/REG, REG, or shared */
+    int64_t off[APSIZE], dynMask[APSIZE], regMask[APSIZE], shMask[APSIZE];
+  } AppCode;
+
+/* How OP_APP fills in a heap app: the relocation of PTR atoms and the
+   fetching of ARG/REG atoms are done a lane at a time, all four PTR
+   lanes at once with SSE2, or with SSE2 and all the ARG/REG lanes in
+   a single AVX2 gather.  The best the CPU has is picked at startup,
+   unless REDUCERON_KERNEL names one. */
+
+typedef enum { KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2 } Kernel;
+
+static const char *kernelNames[] = { "scalar", "sse2", "avx2" };
+static Kernel appKernel;
+
+void selectKernel(void)
+{
+  const char *want = getenv("REDUCERON_KERNEL");
+  Kernel k, best = KERNEL_SCALAR;
+
+#ifdef X86
+  __builtin_cpu_init();
+#ifdef __SSE2__
+  best = KERNEL_SSE2;
+#endif
+  if (best == KERNEL_SSE2 && __builtin_cpu_supports("avx2"))
+    best = KERNEL_AVX2;
+#endif
+  appKernel = best;
+  if (!want) return;
+  for (k = KERNEL_SCALAR; k <= best; k++)
+    if (strcmp(want, kernelNames[k]) == 0) {
+      appKernel = k;
+      return;
+    }
+  fprintf(stderr, "%s: REDUCERON_KERNEL: %s isn't one of the kernels this "
+          "CPU runs, using %s\n", program_name, want, kernelNames[best]);
+}
+
+#ifdef X86
+/* All of OP_APP for an app with ARG/REG atoms, returning its HT bits:
+   the dynamic lanes are gathered in one go through their addresses
+   (args + off, or regs + off), dashed if shared, and their INT tags
+   collected, then merged with the relocated static lanes */
+
+__attribute__ ((target ("avx2")))
+static UInt instAppAVX2(uint32_t *w, const AppCode *ac, const Atom *args,
+                        const Atom *regs, uint32_t rel)
+{
+  const __m256i dyn = _mm256_loadu_si256((const __m256i *) ac->dynMask);
+  const __m256i reg = _mm256_loadu_si256((const __m256i *) ac->regMask);
+  const __m256i sh  = _mm256_loadu_si256((const __m256i *) ac->shMask);
+  const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  __m256i addr, a, isPtr;
+  __m128i v;
+  UInt ht;
+
+  addr = _mm256_blendv_epi8(_mm256_set1_epi64x((intptr_t) args),
+                            _mm256_set1_epi64x((intptr_t) regs), reg);
+  addr = _mm256_add_epi64(addr,
+                          _mm256_loadu_si256((const __m256i *) ac->off));
+  a = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), NULL, addr,
+                                  dyn, 1);
+
+  /* DASH: bit 31 set and no INT tag above it */
+  isPtr = _mm256_cmpeq_epi64(_mm256_srli_epi64(a, 31),
+                             _mm256_set1_epi64x(1));
+  a = _mm256_or_si256(a, _mm256_and_si256(_mm256_and_si256(isPtr, sh),
+                                          _mm256_set1_epi64x(1 << 30)));
+  ht = ac->ht | _mm256_movemask_pd(_mm256_castsi256_pd(
+                                     _mm256_slli_epi64(a, 31)));
+
+  v = _mm_or_si128(
+        _mm_loadu_si128((const __m128i *) ac->atom),
+        _mm_and_si128(
+          _mm_add_epi32(_mm_loadu_si128((const __m128i *) ac->id),
+                        _mm_set1_epi32(rel)),
+          _mm_loadu_si128((const __m128i *) ac->ptr)));
+  v = _mm_or_si128(v, _mm256_castsi256_si128(
+                        _mm256_permutevar8x32_epi32(a, pack)));
+  _mm_storeu_si128((__m128i *) w, v);
+
+  if (ht & 1)
+    w[1] = setHT(w[1], getHT(w[0]));
+  w[0] = setHT(w[0], ht);
+  return ht;
+}
+#endif
+
+typedef struct {
+    union { Op op; const void *handler; } code;
+    Int index;          // arg/reg index, PTR offset, lut, arity+1
+    Bool shared;
+    Atom atom;          // literal; OP_PRS: the operands
+    Atom atom2;
+    union {
+        AppCode *ac;    // OP_APP
+        Prim prim;      // OP_PRS
+    } u;
+    const App *app;     // OP_PRS: the template app
+  } Instr;
+
+typedef struct ThreadedTemplate {
+    Instr *code;
+    Int redex;                          // arity+1
+    Bool direct;                        // pushes go straight to place
+    Int pushs, luts;                    // budgets checked on entry
+    Bool select;                        // see spineCompare()
+  } ThreadedTemplate;
+
+static Instr *emitPush(Instr *i, Atom a)
+{
+    i->atom = a;
+    if (isPTR(a)) {
+        i->code.op = OP_PUSH_PTR;
+        i->index = getPTRId(a);
+        i->shared = getPTRShared(a);
+    } else if (isARG(a)) {
+        i->code.op = OP_PUSH_ARG;
+        i->index = getARGIndex(a);
+        i->shared = getARGShared(a);
+    } else if (isREG(a)) {
+        i->code.op = OP_PUSH_REG;
+        i->index = getREGIndex(a);
+        i->shared = getREGShared(a);
+    } else
+        i->code.op = OP_PUSH;
+    return i + 1;
+}
+
+static void decodeApp(const App *app, AppCode *ac)
+{
+    Int size = getAppSize(*app), k;
+
+    memset(ac, 0, sizeof *ac);
+    for (k = 0; k < APSIZE; ++k) {
+        Atom a = k < size ? getAppAtom(*app, k) : mkINV();
+
+        ac->atom[k] = a;
+        if (isINT(a))
+            ac->ht |= 1 << k;
+        else if (isPTR(a)) {
+            ac->atom[k] = a & ~PTRIDMASK;
+            ac->id[k] = a & PTRIDMASK;
+            ac->ptr[k] = PTRIDMASK;
+        }
+        else if (isARG(a) || isREG(a)) {
+            Bool reg = isREG(a);
+            Int index = reg ? getREGIndex(a) : getARGIndex(a);
+
+            ac->atom[k] = 0;
+            ac->dyn[ac->numDyn].slot = k;
+            ac->dyn[ac->numDyn].reg = reg;
+            ac->dyn[ac->numDyn].index = index;
+            ac->dyn[ac->numDyn].shared = reg ? getREGShared(a)
+                                             : getARGShared(a);
+            ac->numDyn++;
+            ac->off[k] = (reg ? index : -index) * (int64_t) sizeof(Atom);
+            ac->dynMask[k] = -1;
+            ac->regMask[k] = reg ? -1 : 0;
+            ac->shMask[k] = ac->dyn[ac->numDyn-1].shared ? -1 : 0;
+        }
+    }
+    if (getAppTag(*app) == CASE)
+        ac->atom[3] = mkLUT(getAppLUT(*app));
+    else
+        ac->ht |= getAppNF(*app) << HT_NF;
+}
+
+/* Can the pushes of t be written straight over the redex, or would
+   that overwrite an argument a later push still has to read? */
+
+static Bool directPushes(const Template *t)
+{
+    Int j, written = 0;
+
+    for (j = t->numPushs-1; j >= 0; j--, written++)
+        if (isARG(t->pushs[j]) &&
+            (Int) getARGIndex(t->pushs[j]) >= t->arity - written)
+            return 0;
+    return 1;
+}
+
+/* Case selection on a speculated comparison
+
+   The compiler puts a comparison that a case scrutinises in the spine
+   of the template, under the case table: (x <= y) of alternatives
+   becomes a spine of x, (<=), y with the table pushed last.  Applied,
+   that takes a prim step and then a case selection before the
+   alternative is applied.  When the operands are already numbers the
+   outcome is known as the template is applied, like that of a
+   speculated PRIM app (see instApp()), so the template's slide is
+   decoded as an OP_SELECT, which takes both steps at once and goes
+   straight on to the alternative.  Is t such a template? */
+
+static Bool spineCompare(const Template *t)
+{
+    Atom p;
+
+    if (t->numLuts == 0 || t->numPushs < 3 || !isPRI(t->pushs[1]))
+        return 0;
+    p = t->pushs[1];
+    return (getPRIId(p) == EQ || getPRIId(p) == NEQ || getPRIId(p) == LEQ) &&
+           !isPTR(t->pushs[0]) && !isPTR(t->pushs[2]);
+}
+
+void freeDecoded(Machine *m)
+{
+    freeJit(m);
+    free(m->threaded);
+    free(m->threadedInstrs);
+    free(m->threadedApps);
+    m->threaded = NULL;
+    m->threadedInstrs = m->threadedApps = NULL;
+}
+
+void decodeTemplates(Machine *m)
+{
+    /* Upper bound: luts + apps + pushs + slide */
+    const Int maxInstrs = MAXLUTS + MAXAPS + MAXPUSH + 1;
+    Instr *i;
+    AppCode *ac;
+    Int t, j;
+
+    freeDecoded(m);
+    m->selectTemplates = 0;
+    m->threaded = malloc(sizeof(ThreadedTemplate) * m->numTemplates);
+    m->threadedInstrs = i = calloc(maxInstrs * m->numTemplates, sizeof(Instr));
+    m->threadedApps = ac = malloc(sizeof(AppCode) * MAXAPS * m->numTemplates);
+    if (!m->threaded || !i || !ac)
+        fail(RED_ENOMEM, "out of memory decoding templates");
+
+    for (t = 0; t < m->numTemplates; ++t) {
+        const Template *tp = &m->code[t];
+        m->threaded[t].code = i;
+        m->threaded[t].redex = tp->arity+1;
+        m->threaded[t].direct = directPushes(tp);
+        m->threaded[t].pushs = tp->numPushs;
+        m->threaded[t].luts = tp->numLuts;
+        m->threaded[t].select = spineCompare(tp);
+        m->selectTemplates += m->threaded[t].select;
+
+        for (j = tp->numLuts-1; j >= 0; j--, i++) {
+            i->code.op = OP_LUT;
+            i->index = tp->luts[j];
+        }
+
+        for (j = 0; j < tp->numApps; j++, i++) {
+            const App *app = &tp->apps[j];
+
+            if (getAppTag(*app) == PRIM) {
+                i->code.op = OP_PRS;
+                i->index = getAppRegId(*app);
+                i->atom = getAppAtom(*app, 0);
+                i->atom2 = getAppAtom(*app, 2);
+                i->u.prim = getPRIId(getAppAtom(*app, 1));
+                i->app = app;
+            } else {
+                i->u.ac = ac;
+                decodeApp(app, ac);
+                i->code.op =
+                    appKernel == KERNEL_SCALAR ? OP_APP :
+                    appKernel == KERNEL_AVX2 && ac->numDyn ? OP_APP_AVX2 :
+                    OP_APP_SSE2;
+                ac++;
+            }
+        }
+
+        for (j = tp->numPushs-1; j >= 0; j--)
+            i = emitPush(i, tp->pushs[j]);
+
+        i->code.op = m->threaded[t].select ? OP_SELECT :
+                     m->threaded[t].direct ? OP_END : OP_SLIDE;
+        i->index = m->threaded[t].direct ? 0 : tp->arity+1;
+        i++;
+    }
+}
+
+/* Slow path of OP_PRS when an operand isn't yet a number */
+
+static void instPrimApp(Machine *m, Int base, Int argPtr, const App *app)
+{
+    Atom atoms[APSIZE];
+    Int i;
+
+    m->registers[getAppRegId(*app)] = mkPTR(0, m->hp);
+    for (i = 0; i < getAppSize(*app); i++)
+        atoms[i] = inst(m, base, argPtr, getAppAtom(*app, i));
+    m->heap[m->hp++] = mkApp(AP, getAppSize(*app), 0, 0, atoms);
+}
+
+/* Template JIT
+
+   With -d jit the threaded engine compiles each template to x86-64
+   code the first time it is applied and from then on calls that
+   instead of running its instructions.  The code writes the apps
+   straight into the heap, words and head tags as far as possible
+   worked out at compile time, with the argument and register offsets
+   and the relocation of PTR atoms baked in; evaluates primitive
+   redexes inline, building the app when an operand isn't a number
+   yet; and writes the pushes over the redex, staging them above it
+   first when a push would overwrite an argument still to be read.  It
+   is called as
+
+     Int code(Atom *args, App *heap, Int hp, Lut *luts, Long *prs,
+              Atom *regs)
+
+   with args the address of argument 0 (the engine's argPtr), luts
+   where the case tables go and prs the PRS candidate and success
+   counts, and returns the new heap pointer; the engine moves the
+   stack and case stack pointers itself.  Templates with a primitive
+   redex it has no inline code for are left to the interpreter, as
+   is every template once the code space is full. */
+
+#ifdef __x86_64__
+#define JIT 1
+#endif
+
+#define JITSPACE 4096                   // code bytes per template
+#define JITSAMPLE 63                    // one apply in 64 timed
+
+#ifdef JIT
+typedef struct {
+    uint8_t *p, *end;
+  } Emitter;
+
+static void emitBytes(Emitter *e, const uint8_t *b, Int n)
+{
+  if (e->p + n > e->end) {
+    e->p = e->end + 1;                  // full, and stays so
+    return;
+  }
+  memcpy(e->p, b, n);
+  e->p += n;
+}
+
+#define EMIT(...) do { const uint8_t b_[] = { __VA_ARGS__ }; \
+                       emitBytes(e, b_, sizeof b_); } while (0)
+
+static void emit32(Emitter *e, uint32_t x)
+{
+  EMIT(x, x >> 8, x >> 16, x >> 24);
+}
+
+static void emit64(Emitter *e, uint64_t x)
+{
+  emit32(e, x);
+  emit32(e, x >> 32);
+}
+
+/* rax (or rcx) = the atom a of the template, as PRIMARG() and, if
+   shared, DASH() in the threaded engine; args are at rdi, registers
+   at r9, and ebx holds the heap base shifted into place for PTRs */
+
+static void jitLoad(Emitter *e, Atom a, Bool toRcx)
+{
+  Bool sh = 0;
+
+  if (isARG(a)) {
+    EMIT(0x48, 0x8B, toRcx ? 0x8F : 0x87);      // mov r, [rdi+d32]
+    emit32(e, -8 * (Int) getARGIndex(a));
+    sh = getARGShared(a);
+  } else if (isREG(a)) {
+    EMIT(0x49, 0x8B, toRcx ? 0x89 : 0x81);      // mov r, [r9+d32]
+    emit32(e, 8 * getREGIndex(a));
+    sh = getREGShared(a);
+  } else if (isPTR(a) && !toRcx) {
+    EMIT(0xB8);                                 // mov eax, id
+    emit32(e, (getPTRId(a) << HT) & PTRIDMASK);
+    EMIT(0x01, 0xD8);                           // add eax, ebx
+    EMIT(0x25); emit32(e, PTRIDMASK);           // and eax, mask
+    EMIT(0x0D); emit32(e, (UInt) a & ~PTRIDMASK & ~0U << HT); // or eax
+  } else {
+    EMIT(0x48, toRcx ? 0xB9 : 0xB8);            // mov r, imm64
+    emit64(e, a);
+  }
+  if (sh && !toRcx) {
+    EMIT(0x48, 0x89, 0xC1);                     // mov rcx, rax
+    EMIT(0x48, 0xC1, 0xE9, 31);                 // shr rcx, 31
+    EMIT(0x48, 0x83, 0xF9, 0x01);               // cmp rcx, 1
+    EMIT(0x75, 0x05);                           // jne +5
+    EMIT(0x48, 0x0F, 0xBA, 0xE8, 30);           // bts rax, 30
+  }
+}
+
+/* The app ac at r11 (the heap pointer r10 scaled), then on to the
+   next, as op_app */
+
+static void jitApp(Emitter *e, const AppCode *ac)
+{
+  Int k, i;
+
+  if (!ac->numDyn) {
+    /* Everything but PTR relocation known now */
+    uint32_t w[APSIZE];
+
+    for (k = 0; k < APSIZE; k++) w[k] = ac->atom[k];
+    if (ac->ht & 1) w[1] = setHT(w[1], getHT(w[0]));
+    w[0] = setHT(w[0], ac->ht);
+    for (k = 0; k < APSIZE; k++) {
+      if (ac->ptr[k]) {
+        EMIT(0xB8); emit32(e, ac->id[k]);       // mov eax, id
+        EMIT(0x01, 0xD8);                       // add eax, ebx
+        EMIT(0x25); emit32(e, ac->ptr[k]);      // and eax, mask
+        EMIT(0x0D); emit32(e, w[k]);            // or eax, rest
+        EMIT(0x41, 0x89, 0x43, 4*k);            // mov [r11+4k], eax
+      } else {
+        EMIT(0x41, 0xC7, 0x43, 4*k);            // mov [r11+4k], imm32
+        emit32(e, w[k]);
+      }
+    }
+  } else {
+    EMIT(0xBA); emit32(e, ac->ht);              // mov edx, ht
+    for (k = 0; k < APSIZE; k++) {
+      for (i = 0; i < ac->numDyn && ac->dyn[i].slot != k; i++)
+        ;
+      if (i < ac->numDyn) {
+        Atom a = ac->dyn[i].reg ? mkREG(ac->dyn[i].shared, ac->dyn[i].index)
+                                : mkARG(ac->dyn[i].shared, ac->dyn[i].index);
+        jitLoad(e, a, 0);
+        EMIT(0x41, 0x89, 0x43, 4*k);            // mov [r11+4k], eax
+        EMIT(0x48, 0x89, 0xC1);                 // mov rcx, rax
+        EMIT(0x48, 0xC1, 0xE9, 32);             // shr rcx, 32
+        if (k) EMIT(0xC1, 0xE1, k);             // shl ecx, k
+        EMIT(0x09, 0xCA);                       // or edx, ecx
+      } else if (ac->ptr[k]) {
+        EMIT(0xB8); emit32(e, ac->id[k]);
+        EMIT(0x01, 0xD8);
+        EMIT(0x25); emit32(e, ac->ptr[k]);
+        EMIT(0x0D); emit32(e, ac->atom[k]);
+        EMIT(0x41, 0x89, 0x43, 4*k);
+      } else {
+        EMIT(0x41, 0xC7, 0x43, 4*k);
+        emit32(e, ac->atom[k]);
+      }
+    }
+    /* A number in atom 0 keeps its HT bits in atom 1 */
+    EMIT(0xF6, 0xC2, 0x01);                     // test dl, 1
+    EMIT(0x74, 19);                             // jz +19
+    EMIT(0x41, 0x8B, 0x03);                     // mov eax, [r11]
+    EMIT(0x83, 0xE0, 0x1F);                     // and eax, 31
+    EMIT(0x41, 0x8B, 0x4B, 0x04);               // mov ecx, [r11+4]
+    EMIT(0x83, 0xE1, 0xE0);                     // and ecx, ~31
+    EMIT(0x09, 0xC1);                           // or ecx, eax
+    EMIT(0x41, 0x89, 0x4B, 0x04);               // mov [r11+4], ecx
+    EMIT(0x41, 0x8B, 0x03);                     // mov eax, [r11]
+    EMIT(0x83, 0xE0, 0xE0);                     // and eax, ~31
+    EMIT(0x09, 0xD0);                           // or eax, edx
+    EMIT(0x41, 0x89, 0x03);                     // mov [r11], eax
+  }
+  EMIT(0x49, 0xFF, 0xC2);                       // inc r10
+  EMIT(0x49, 0x83, 0xC3, 0x10);                 // add r11, 16
+}
+
+/* A primitive redex, as op_prs, or 0 if there's no inline code for it */
+
+static Bool jitPrs(Emitter *e, const App *app)
+{
+  Prim p = getPRIId(getAppAtom(*app, 1));
+  Int rid = getAppRegId(*app), i;
+  Atom atoms[APSIZE];
+  App ap;
+  AppCode ac;
+  uint8_t *slow, *done;
+
+  if (p != ADD && p != SUB && p != MUL && p != AND && p != OR && p != XOR &&
+      p != EQ && p != NEQ && p != LEQ)
+    return 0;
+  EMIT(0x49, 0xFF, 0x00);                       // inc qword [r8]
+  jitLoad(e, getAppAtom(*app, 0), 0);           // no DASH, as PRIMARG()
+  jitLoad(e, getAppAtom(*app, 2), 1);
+  EMIT(0x48, 0x89, 0xC2);                       // mov rdx, rax
+  EMIT(0x48, 0x21, 0xCA);                       // and rdx, rcx
+  EMIT(0x48, 0xC1, 0xEA, 32);                   // shr rdx, 32
+  EMIT(0x0F, 0x84); emit32(e, 0);               // jz slow
+  slow = e->p;
+  switch (p) {
+  case ADD: EMIT(0x01, 0xC8); break;            // add eax, ecx
+  case SUB: EMIT(0x29, 0xC8); break;            // sub eax, ecx
+  case MUL: EMIT(0x0F, 0xAF, 0xC1); break;      // imul eax, ecx
+  case AND: EMIT(0x21, 0xC8); break;            // and eax, ecx
+  case OR:  EMIT(0x09, 0xC8); break;            // or eax, ecx
+  case XOR: EMIT(0x31, 0xC8); break;            // xor eax, ecx
+  default:
+    EMIT(0x39, 0xC8);                           // cmp eax, ecx
+    EMIT(0x48, 0xB8); emit64(e, falseAtom);     // mov rax, False
+    EMIT(0x48, 0xBA); emit64(e, trueAtom);      // mov rdx, True
+    EMIT(0x48, 0x0F, p == EQ ? 0x44 : p == NEQ ? 0x45 : 0x4E, 0xC2);
+    break;                                      // cmovcc rax, rdx
+  }
+  if (p != EQ && p != NEQ && p != LEQ)
+    EMIT(0x48, 0x0F, 0xBA, 0xE8, 32);           // bts rax, 32
+  EMIT(0x49, 0x89, 0x81); emit32(e, 8*rid);     // mov [r9+8r], rax
+  EMIT(0x49, 0xFF, 0x40, 0x08);                 // inc qword [r8+8]
+  EMIT(0xE9); emit32(e, 0);                     // jmp done
+  done = e->p;
+
+  /* Not numbers yet: the register points to the app, as instPrimApp() */
+  if (e->p <= e->end) {
+    Int rel = e->p - slow;
+    memcpy(slow - 4, &rel, 4);
+  }
+  EMIT(0x44, 0x89, 0xD0);                       // mov eax, r10d
+  EMIT(0xC1, 0xE0, HT);                         // shl eax, HT
+  EMIT(0x25); emit32(e, PTRIDMASK);             // and eax, mask
+  EMIT(0x0D); emit32(e, 1U << 31);              // or eax, PTR tag
+  EMIT(0x49, 0x89, 0x81); emit32(e, 8*rid);     // mov [r9+8r], rax
+  for (i = 0; i < (Int) getAppSize(*app); i++) atoms[i] = getAppAtom(*app, i);
+  ap = mkApp(AP, getAppSize(*app), 0, 0, atoms);
+  decodeApp(&ap, &ac);
+  jitApp(e, &ac);
+  if (e->p <= e->end) {
+    Int rel = e->p - done;
+    memcpy(done - 4, &rel, 4);
+  }
+  return 1;
+}
+
+/* The code of template t at e->p, or NULL */
+
+static JitCode jitTemplate(Emitter *e, const Template *t)
+{
+  uint8_t *start = e->p;
+  Bool direct = directPushes(t);
+  Int j, k, at;
+  AppCode ac;
+
+  EMIT(0x53);                                   // push rbx
+  EMIT(0x4C, 0x63, 0xD2);                       // movsxd r10, edx
+  EMIT(0x89, 0xD3);                             // mov ebx, edx
+  EMIT(0xC1, 0xE3, HT);                         // shl ebx, HT
+  EMIT(0x4D, 0x89, 0xD3);                       // mov r11, r10
+  EMIT(0x49, 0xC1, 0xE3, 0x04);                 // shl r11, 4
+  EMIT(0x49, 0x01, 0xF3);                       // add r11, rsi
+
+  for (j = t->numLuts-1, k = 0; j >= 0; j--, k++) {
+    EMIT(0xC7, 0x81); emit32(e, 4*k);           // mov [rcx+4k], imm32
+    emit32(e, t->luts[j]);
+  }
+
+  for (j = 0; j < t->numApps; j++) {
+    const App *app = &t->apps[j];
+
+    if (getAppTag(*app) == PRIM) {
+      if (!jitPrs(e, app)) return NULL;
+    } else {
+      decodeApp(app, &ac);
+      jitApp(e, &ac);
+    }
+  }
+
+  /* Pushes over the redex, or above it and then moved down */
+  at = direct ? 2 - (t->arity+1) : 2;
+  for (j = t->numPushs-1, k = 0; j >= 0; j--, k++) {
+    jitLoad(e, t->pushs[j], 0);
+    EMIT(0x48, 0x89, 0x87); emit32(e, 8*(at+k)); // mov [rdi+d32], rax
+  }
+  if (!direct)
+    for (k = 0; k < t->numPushs; k++) {
+      EMIT(0x48, 0x8B, 0x87); emit32(e, 8*(2+k));
+      EMIT(0x48, 0x89, 0x87); emit32(e, 8*(2-(t->arity+1)+k));
+    }
+
+  EMIT(0x44, 0x89, 0xD0);                       // mov eax, r10d
+  EMIT(0x5B);                                   // pop rbx
+  EMIT(0xC3);                                   // ret
+  return e->p <= e->end ? (JitCode) (uintptr_t) start : NULL;
+}
+
+#undef EMIT
+#endif
+
+typedef struct Jit {
+    uint8_t *space;
+    size_t size, used;
+    JitCode *code;                      // by template, once compiled
+    Bool *tried;
+    Int compiled;
+  } Jit;
+
+void freeJit(Machine *m)
+{
+  Jit *j = m->jitState;
+
+  if (!j) return;
+  if (j->space)
+    mprotect(j->space, j->size, PROT_READ | PROT_WRITE);
+  free(j->space);
+  free(j->code);
+  free(j->tried);
+  free(j);
+  m->jitState = NULL;
+}
+
+static Jit *initJit(Machine *m)
+{
+  Jit *j = m->jitState;
+  size_t page;
+
+  Int i;
+
+  if (j) return j;
+  if (!(j = m->jitState = calloc(1, sizeof(Jit))))
+    fail(RED_ENOMEM, "out of memory for the JIT");
+  j->code = calloc(m->numTemplates, sizeof(JitCode));
+  j->tried = calloc(m->numTemplates, sizeof(Bool));
+  if (!j->code || !j->tried)
+    fail(RED_ENOMEM, "out of memory for the JIT");
+
+  /* red2c code, the JIT (if on) compiling whatever red2c left out */
+  if (m->nativeCode)
+    for (i = 0; i < m->numTemplates; i++) {
+      j->code[i] = m->nativeCode[i];
+      j->tried[i] = j->code[i] || !m->jit;
+      j->compiled += j->code[i] != NULL;
+    }
+  if (m->jit) {
+    /* Whole pages, for mprotect() */
+    page = sysconf(_SC_PAGESIZE);
+    j->size = ((size_t) JITSPACE * m->numTemplates + page-1) / page * page;
+    if (posix_memalign((void **) &j->space, page, j->size))
+      fail(RED_ENOMEM, "out of memory for the JIT");
+  }
+  return j;
+}
+
+/* The code of template id, compiled now if this is its first call */
+
+static JitCode jitCode(Machine *m, Int id)
+{
+  Jit *j = initJit(m);
+#ifdef JIT
+  Emitter e;
+  JitCode c;
+#endif
+
+  if (j->tried[id]) return j->code[id];
+  j->tried[id] = 1;
+#ifdef JIT
+  /* Written, then made executable instead */
+  if (mprotect(j->space, j->size, PROT_READ | PROT_WRITE) != 0)
+    fail(RED_ENOMEM, "JIT: %s", strerror(errno));
+  e.p = j->space + j->used;
+  e.end = j->space + j->size;
+  c = jitTemplate(&e, &m->code[id]);
+  if (c) {
+    j->used = e.p - j->space;
+    j->compiled++;
+  }
+  if (mprotect(j->space, j->size, PROT_READ | PROT_EXEC) != 0)
+    fail(RED_ENOMEM, "JIT: %s", strerror(errno));
+  j->code[id] = c;
+#endif
+  return j->code[id];
+}
+
+/* red2c
+
+   With -c, the program is written out as C instead of being run: a
+   function per template doing what applying it does in the threaded
+   engine (the apps, case tables, primitive redexes and pushes of
+   jitTemplate(), as JitCode), a table of them, and the .red text
+   itself.  Built with -DREDUCERON_RUNTIME, this file is the runtime
+   that C is linked with (libreduceron-rt.a): the same emulator, its
+   options and report, running the built-in program on the threaded
+   engine with the functions in place of the templates, so ticks are
+   those of -d threaded.  Templates with a primitive redex that isn't
+   pure arithmetic are left to the interpreter. */
+
+static const char cPrelude[] =
+  "#include <stdbool.h>\n"
+  "#include \"red_atom.h\"\n"
+  "\n"
+  "#define PTRIDMASK   (~(~0U << (30 - HT)) << HT)\n"
+  "#define INT(n)      ((Atom) (uint32_t) (n) | 1ULL << 32)\n"
+  "#define PTR(sh, i)  ((Atom) (1U << 31 | (sh) << 30 | \\\n"
+  "                     ((UInt) (base + (i)) << HT & PTRIDMASK)))\n"
+  "#define DASH(sh, a) ((sh) && (a) >> 31 == 1 ? (a) | 1 << 30 : (a))\n"
+  "#define ARG(sh, i)  DASH(sh, args[-(i)])\n"
+  "#define REG(sh, i)  DASH(sh, regs[i])\n"
+  "\n"
+  "/* A heap app from its atoms and the HT bits known beforehand */\n"
+  "\n"
+  "static inline void app(App *p, UInt ht, Atom a0, Atom a1, Atom a2, Atom a3)\n"
+  "{\n"
+  "  ht |= a0 >> 32 | a1 >> 32 << 1 | a2 >> 32 << 2 | a3 >> 32 << 3;\n"
+  "  p->atom[0] = a0;\n"
+  "  p->atom[1] = a1;\n"
+  "  p->atom[2] = a2;\n"
+  "  p->atom[3] = a3;\n"
+  "  if (ht & 1)\n"
+  "    p->atom[1] = setHT(a1, getHT(a0));\n"
+  "  p->atom[0] = setHT(a0, ht);\n"
+  "}\n";
+
+/* The C for template atom a, as inst() makes it, or as PRIMARG() if
+   prim */
+
+static void writeCAtom(FILE *f, Atom a, Bool prim)
+{
+  if (isPTR(a))
+    fprintf(f, "PTR(%d, %d)", getPTRShared(a), getPTRId(a));
+  else if (isARG(a) && prim)
+    fprintf(f, "args[-%u]", getARGIndex(a));
+  else if (isARG(a))
+    fprintf(f, "ARG(%d, %u)", getARGShared(a), getARGIndex(a));
+  else if (isREG(a) && prim)
+    fprintf(f, "regs[%u]", getREGIndex(a));
+  else if (isREG(a))
+    fprintf(f, "REG(%d, %u)", getREGShared(a), getREGIndex(a));
+  else
+    fprintf(f, "0x%llxULL", (unsigned long long) a);
+}
+
+static void writeCApp(FILE *f, const App *app, AppTag tag, const char *indent)
+{
+  Int size = getAppSize(*app), k;
+
+  fprintf(f, "%sapp(heap + hp++, 0x%x", indent,
+          tag == AP ? getAppNF(*app) << HT_NF : 0);
+  for (k = 0; k < APSIZE; k++) {
+    fprintf(f, ", ");
+    if (tag == CASE && k == APSIZE-1)
+      writeCAtom(f, mkLUT(getAppLUT(*app)), 0);
+    else
+      writeCAtom(f, k < size ? getAppAtom(*app, k) : mkINV(), 0);
+  }
+  fprintf(f, ");\n");
+}
+
+/* prim() on the numbers a and b, for the primitives that have no
+   effect, and the condition under which it doesn't fail */
+
+static const char *cPrim(Prim p, const char **ok)
+{
+  *ok = "";
+  switch (p) {
+  case ADD: return "INT((UInt) a + (UInt) b)";
+  case SUB: return "INT((UInt) a - (UInt) b)";
+  case MUL: return "INT((UInt) a * (UInt) b)";
+  case AND: return "INT((UInt) a & (UInt) b)";
+  case OR:  return "INT((UInt) a | (UInt) b)";
+  case XOR: return "INT((UInt) a ^ (UInt) b)";
+  case EQ:  return "(Int) a == (Int) b ? TRUE : FALSE";
+  case NEQ: return "(Int) a != (Int) b ? TRUE : FALSE";
+  case LEQ: return "(Int) a <= (Int) b ? TRUE : FALSE";
+  case QUOT:
+    *ok = " && (Int) b != 0";
+    return "INT((Int) b == -1 ? -(UInt) a : (UInt) ((Int) a / (Int) b))";
+  case REM:
+    *ok = " && (Int) b != 0";
+    return "INT((Int) b == -1 ? 0 : (Int) a % (Int) b)";
+  case SHL:
+    *ok = " && (Int) b >= 0";
+    return "INT((Int) b < 32 ? (UInt) a << (Int) b : 0)";
+  case SHR:
+    *ok = " && (Int) b >= 0";
+    return "INT((Int) a >> ((Int) b < 32 ? (Int) b : 31))";
+  default:
+    return NULL;
+  }
+}
+
+static Bool usesBase(const Template *t)
+{
+  Int j, k;
+
+  for (j = 0; j < t->numApps; j++)
+    if (getAppTag(t->apps[j]) == PRIM)
+      return 1;
+    else
+      for (k = 0; k < getAppSize(t->apps[j]); k++)
+        if (isPTR(getAppAtom(t->apps[j], k)))
+          return 1;
+  for (j = 0; j < t->numPushs; j++)
+    if (isPTR(t->pushs[j]))
+      return 1;
+  return 0;
+}
+
+/* Template t as the function t<id>, or 0 if it's left to the
+   interpreter */
+
+static Bool writeCTemplate(FILE *f, const Program *prog, Int id)
+{
+  const Template *t = &prog->code[id];
+  const char *name, *ok;
+  Int j, k;
+
+  for (j = 0; j < t->numApps; j++)
+    if (getAppTag(t->apps[j]) == PRIM &&
+        !cPrim(getPRIId(getAppAtom(t->apps[j], 1)), &ok))
+      return 0;
+
+  fprintf(f, "\n// ");
+  for (name = prog->names + t->name; *name; name++)
+    if (*name != '\\') fputc(*name, f);
+  fprintf(f, "\nstatic Int t%d(Atom *args, App *heap, Int hp, Lut *luts, "
+          "Long *prs, Atom *regs)\n{\n", id);
+  if (usesBase(t))
+    fprintf(f, "  const Int base = hp;\n\n");
+
+  for (j = t->numLuts-1, k = 0; j >= 0; j--, k++)
+    fprintf(f, "  luts[%d] = %d;\n", k, t->luts[j]);
+
+  for (j = 0; j < t->numApps; j++) {
+    const App *app = &t->apps[j];
+
+    if (getAppTag(*app) == PRIM) {
+      const char *op = cPrim(getPRIId(getAppAtom(*app, 1)), &ok);
+      Int r = getAppRegId(*app);
+
+      fprintf(f, "  {\n    const Atom a = ");
+      writeCAtom(f, getAppAtom(*app, 0), 1);
+      fprintf(f, ", b = ");
+      writeCAtom(f, getAppAtom(*app, 2), 1);
+      fprintf(f, ";\n\n    prs[0]++;\n"
+              "    if (isINT(a) && isINT(b)%s) {\n"
+              "      prs[1]++;\n"
+              "      regs[%d] = %s;\n"
+              "    } else {\n"
+              "      regs[%d] = PTR(0, hp - base);\n", ok, r, op, r);
+      writeCApp(f, app, AP, "      ");
+      fprintf(f, "    }\n  }\n");
+    } else
+      writeCApp(f, app, getAppTag(*app), "  ");
+  }
+
+  /* All read before any is written over the redex */
+  if (t->numPushs) {
+    fprintf(f, "  {\n");
+    for (j = t->numPushs-1, k = 0; j >= 0; j--, k++) {
+      fprintf(f, "    const Atom p%d = ", k);
+      writeCAtom(f, t->pushs[j], 0);
+      fprintf(f, ";\n");
+    }
+    fprintf(f, "\n");
+    for (k = 0; k < t->numPushs; k++)
+      fprintf(f, "    args[%d] = p%d;\n", 1 - t->arity + k, k);
+    fprintf(f, "  }\n");
+  }
+  fprintf(f, "  return hp;\n}\n");
+  return 1;
+}
+
+void writeC(const Program *prog, const char *redFile, const char *file)
+{
+  FILE *in = fopen(redFile, "r");
+  FILE *f = fopen(file, "w");
+  Bool *compiled = calloc(prog->numTemplates, sizeof(Bool));
+  Int i, c;
+
+  if (!in) fail(RED_EIO, "%s: %s", redFile, strerror(errno));
+  if (!f) fail(RED_EIO, "couldn't write %s: %s", file, strerror(errno));
+  if (!compiled) fail(RED_ENOMEM, "out of memory");
+
+  fprintf(f, "/* %s, compiled by red2c (emu-32-bit -c); link with "
+          "libreduceron-rt.a */\n\n#define APSIZE %d\n%s\n", redFile, APSIZE,
+          cPrelude);
+  fprintf(f, "#define TRUE  0x%llxULL\n#define FALSE 0x%llxULL\n",
+          (unsigned long long) trueAtom, (unsigned long long) falseAtom);
+  for (i = 0; i < prog->numTemplates; i++)
+    compiled[i] = writeCTemplate(f, prog, i);
+
+  fprintf(f, "\nInt (*const redCode[])(Atom *, App *, Int, Lut *, Long *, "
+          "Atom *) = {\n");
+  for (i = 0; i < prog->numTemplates; i++)
+    if (compiled[i])
+      fprintf(f, "  t%d,\n", i);
+    else
+      fprintf(f, "  0,\n");
+  fprintf(f, "};\n\nconst Int redNumCode = %d;\n", prog->numTemplates);
+
+  /* The program itself, for the runtime to parse */
+  fprintf(f, "\nconst char redSource[] =\n  \"");
+  while ((c = getc(in)) != EOF)
+    if (c == '\n')
+      fprintf(f, "\\n\"\n  \"");
+    else if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < ' ' || c > '~')
+      fprintf(f, "\\%03o", c);
+    else
+      fputc(c, f);
+  fprintf(f, "\";\n");
+
+  free(compiled);
+  fclose(in);
+  if (fclose(f) != 0)
+    fail(RED_EIO, "couldn't write %s", file);
+}
+
+/* The pure arithmetic of prim() inline, the rest out of line */
+
+#define ARITH(p, a, b, c) \
+  ((p) == ADD ? mkINT(getINTValue(a) + getINTValue(b)) : \
+   (p) == SUB ? mkINT(getINTValue(a) - getINTValue(b)) : \
+   (p) == EQ  ? (getINTValue(a) == getINTValue(b) ? trueAtom : falseAtom) : \
+   (p) == LEQ ? (getINTValue(a) <= getINTValue(b) ? trueAtom : falseAtom) : \
+   (p) == MUL ? mkINT((UInt) getINTValue(a) * (UInt) getINTValue(b)) : \
+   prim(m, p, a, b, c))
+
+/* Atom i of the packed app w, its number tag taken from bit i of ht.
+   Nothing is recovered from atom 1: r_ptr restores the HT bits of
+   a number in atom 0 itself */
+
+#define HEAPATOM(w, ht, i) ((Atom) (w)[i] | (Atom) (((ht) >> (i)) & 1) << 32)
+
+Bool dispatchThreaded(Machine *m)
+{
+  static const void *ops[LAST_OP] = {
+      [OP_LUT] = &&op_lut, [OP_APP] = &&op_app,
+      [OP_APP_SSE2] = &&op_app_sse2, [OP_APP_AVX2] = &&op_app_avx2,
+      [OP_PRS] = &&op_prs,
+      [OP_PUSH] = &&op_push, [OP_PUSH_PTR] = &&op_push_ptr,
+      [OP_PUSH_ARG] = &&op_push_arg, [OP_PUSH_REG] = &&op_push_reg,
+      [OP_SLIDE] = &&op_slide, [OP_END] = &&op_end,
+      [OP_SELECT] = &&op_select,
+  };
+  /* Indexed by the top four bits of a tagged atom; numbers use the
+     extra entry at the end */
+  static const void *rules[17] = {
+      &&r_con, &&r_pri, &&r_bad, &&r_bad, &&r_fun, &&r_bad, &&r_bad, &&r_bad,
+      &&r_ptr, &&r_ptr, &&r_ptr, &&r_ptr, &&r_ptr, &&r_ptr, &&r_ptr, &&r_ptr,
+      &&r_int,
+  };
+  const Int sLimit = m->maxStackElems - STACKMARGIN;
+  const Int uLimit = m->maxUStackElems - STACKMARGIN;
+  const Int lLimit = m->maxLStackElems - STACKMARGIN;
+  Atom *const st = m->stack;
+  Update *const us = m->ustack;
+  Lut *const ls = m->lstack;
+  Atom *const regs = m->registers;
+  App *hap = m->heap;
+  Atom top;
+  const Instr *pc = NULL;
+  ThreadedTemplate *t;
+  uint32_t *w;
+  Int s = m->sp, h = m->hp, u = m->usp, l = m->lsp;
+  Int hLimit = m->maxHeapApps-HEAPMARGIN;
+  Long unwinds = 0, applies = 0, selects = 0;
+  Long left = m->tickLimit - ticks(m);  // ticks to go
+  Int base = 0, argPtr = 0, spOld = 0, d = 0, i;
+  Long jits = 0, prs[2] = { 0, 0 }, sampled = 0;
+  Long prsSelects = 0, prsSelectHits = 0;
+  JitCode *jcode = NULL;
+  const Bool *jtried = NULL;
+
+  if (!m->threaded) {
+      decodeTemplates(m);
+      for (i = 0; i < m->numTemplates; ++i)
+          for (Instr *p = m->threaded[i].code; ; ++p) {
+              Op op = p->code.op;
+              p->code.handler = ops[op];
+              if (op == OP_SLIDE || op == OP_END || op == OP_SELECT) break;
+          }
+  }
+  /* After decoding, which frees any code compiled before */
+  if (m->jit || m->nativeCode) {
+      jcode = initJit(m)->code;
+      jtried = m->jitState->tried;
+  }
+
+  /* The machine registers live in locals and are written back around
+     calls into the rest of the emulator */
+#define SAVE  (m->sp = s, m->hp = h, m->usp = u, m->lsp = l, \
+               m->unwindCount += unwinds, m->applyCount += applies, \
+               m->selectCount += selects, unwinds = applies = selects = 0, \
+               m->jitApplyCount += jits, m->prsCandidateCount += prs[0], \
+               m->prsSuccessCount += prs[1], jits = prs[0] = prs[1] = 0, \
+               m->prsSelectCount += prsSelects, \
+               m->prsSelectHits += prsSelectHits, \
+               prsSelects = prsSelectHits = 0)
+#define LOAD  (s = m->sp, h = m->hp, u = m->usp, l = m->lsp, \
+               hap = m->heap, hLimit = m->maxHeapApps-HEAPMARGIN)
+#define NEXT  goto *pc++->code.handler
+#define STEP  do { top = st[s-1]; \
+                   goto *rules[isINT(top) ? 16 : (UInt) top >> 28]; } while (0)
+#define UPDATE_CHECK(ar) \
+  if (u > 0 && (ar) > s - us[u-1].saddr) goto r_update
+#define DASH(sh, a) ((sh) && isPTR(a) ? (a) | 1 << 30 : (a))
+#define PRIMARG(a) \
+  (isARG(a) ? st[argPtr - getARGIndex(a)] : \
+   isREG(a) ? regs[getREGIndex(a)] : (a))
+
+  STEP;
+
+r_ptr: {
+      Int addr = getPTRId(top);
+      UInt ht0, size;
+      Bool sh = getPTRShared(top);
+      Bool isCase;
+
+      w = hap[addr].atom;
+      ht0 = getHT(w[0]);
+      size = 1 + !isINV(w[1]) + !isINV(w[2]) + !isINV(w[3]);
+      isCase = isLUT(w[3]);
+      if (sh && (isCase || !((ht0 >> HT_NF) & 1))) {
+          us[u].saddr = s;
+          us[u].haddr = addr;
+          if (++u > uLimit) { SAVE; stackOverflow(m, "update stack"); }
+      }
+      if (isCase) {
+          ls[l] = getLUTIndex(w[3]);
+          if (++l > lLimit) { SAVE; stackOverflow(m, "case stack"); }
+      }
+      s--;
+      if (isLONG(w[3])) {
+          Int i;
+          for (i = getLONGSize(w[3])-1; i >= 0; i--) {
+              Atom a = longAtom(&hap[addr], i);
+              st[s++] = sh && isPTR(a) ? a | 1 << 30 : a;
+          }
+      }
+      switch (size) {
+      case 4: {
+          Atom a = HEAPATOM(w, ht0, 3);
+          st[s++] = sh && isPTR(a) ? a | 1 << 30 : a;
+      }
+      case 3: {
+          Atom a = HEAPATOM(w, ht0, 2);
+          st[s++] = sh && isPTR(a) ? a | 1 << 30 : a;
+      }
+      case 2: {
+          Atom a = HEAPATOM(w, ht0, 1);
+          st[s++] = sh && isPTR(a) ? a | 1 << 30 : a;
+      }
+      }
+      top = HEAPATOM(w, ht0, 0);
+      if (isINT(top))
+          top = setHT(top, getHT(w[1]));
+      else if (sh && isPTR(top))
+          top |= 1 << 30;
+      st[s++] = top;
+      unwinds++;
+      left--;
+
+      if (s > sLimit) { SAVE; stackOverflow(m, "stack"); }
+      goto *rules[isINT(top) ? 16 : (UInt) top >> 28];
+  }
+
+r_int:
+  if (s == 1) {
+      SAVE;
+      return 1;
+  }
+  UPDATE_CHECK(1);
+  left--;
+  {
+      /* As applyPrim() */
+      Atom p = st[s-2];
+      Prim pid = getPRIId(p);
+
+      assert(isPRI(p));
+      if (pid == SEQ) {
+          st[s-2] = st[s-3];
+          st[s-3] = top;
+          s--;
+          m->primCount++;
+      } else if (isINT(st[s-3]) || pid == EMIT || pid == EMITINT) {
+          Atom c = st[4 <= s ? s-4 : 0];
+          if (getPRISwap(p))
+              st[s-3] = ARITH(pid, st[s-3], top, c);
+          else
+              st[s-3] = ARITH(pid, top, st[s-3], c);
+          s -= getPRIArity(p);
+          m->primCount++;
+      } else {
+          st[s-2] = togglePRISwap(p);
+          st[s-1] = st[s-3];
+          st[s-3] = top;
+          m->swapCount++;
+      }
+  }
+  STEP;
+
+r_con:
+  UPDATE_CHECK(getCONArity(top) + 1);
+  /* As caseSelect(); the alternative is applied next */
+  selects++;
+  top = mkFUN(1, 0, ls[--l] + getCONIndex(top));
+  st[s-1] = top;
+  goto r_fun;
+
+r_pri:
+  UPDATE_CHECK(getPRIArity(top));
+  SAVE;
+  error("dispatch(): invalid tag.");
+
+r_bad:
+  SAVE;
+  if (u > 0)
+      error("arity(): invalid tag");
+  error("dispatch(): invalid tag.");
+
+r_update: {
+      /* As update(), inline when the result fits in one app */
+      Int len = 1 + s - us[u-1].saddr;
+
+      if (len < APSIZE && !m->numSqueezed) {
+          Atom atoms[APSIZE];
+          Int k, j;
+
+          atoms[0] = top;
+          for (k = 1, j = s-2; k < len; k++, j--)
+              atoms[k] = st[j] = DASH(1, st[j]);
+          hap[us[u-1].haddr] = mkApp(AP, len <= 0 ? 1 : len, 1, 0, atoms);
+          if (us[u-1].haddr < m->nurseryBase) remember(m, us[u-1].haddr);
+          u--;
+      } else {
+          SAVE;
+          update(m, top, us[u-1].saddr, us[u-1].haddr);
+          LOAD;
+      }
+  }
+  m->updateCount++;
+  left--;
+  if (h > hLimit) goto gc;
+  STEP;
+
+  /* Only apply and update allocate, so this is where dispatch() would
+     find the heap full at the start of the next step */
+gc:
+  top = st[s-1];
+  if (isFUN(top) && !getFUNOriginal(top))
+      goto r_fun;
+  SAVE;
+  collect(m);
+  LOAD;
+  STEP;
+
+r_fun:
+  UPDATE_CHECK(getFUNArity(top));
+  if (left <= 0) {
+      SAVE;
+      return 0;
+  }
+  t = &m->threaded[getFUNId(top)];
+  if (s + t->pushs > sLimit) { SAVE; stackOverflow(m, "stack"); }
+  if (l + t->luts > lLimit) { SAVE; stackOverflow(m, "case stack"); }
+  m->profTable[getFUNId(top)].callCount++;
+  applies++;
+  left--;
+  if (jcode) {
+      Int id = getFUNId(top);
+      JitCode c = jtried[id] ? jcode[id] : jitCode(m, id);
+
+      sampled = applies & JITSAMPLE ? 0 : cycles();
+      if (c) {
+          h = c(st + s-2, hap, h, ls + l, prs, regs);
+          l += t->luts;
+          s += t->pushs - t->redex;
+          jits++;
+          if (sampled) m->jitCycles += cycles() - sampled;
+          sampled = 0;
+          if (h > hLimit) goto gc;
+          if (t->select) goto cmp_select;
+          STEP;
+      }
+  }
+  base = h;
+  spOld = s;
+  argPtr = s-2;
+  d = t->direct ? s - t->redex : s;
+  pc = t->code;
+  NEXT;
+
+op_lut:
+  ls[l++] = pc[-1].index;
+  NEXT;
+
+op_app: {
+      /* As instApp() */
+      const AppCode *ac = pc[-1].u.ac;
+      const uint32_t rel = base << HT;
+      UInt ht = ac->ht;
+
+      w = hap[h].atom;
+      w[0] = ac->atom[0] | ((ac->id[0] + rel) & ac->ptr[0]);
+      w[1] = ac->atom[1] | ((ac->id[1] + rel) & ac->ptr[1]);
+      w[2] = ac->atom[2] | ((ac->id[2] + rel) & ac->ptr[2]);
+      w[3] = ac->atom[3] | ((ac->id[3] + rel) & ac->ptr[3]);
+      for (i = 0; i < ac->numDyn; ++i) {
+          Int k = ac->dyn[i].slot;
+          Atom a = ac->dyn[i].reg
+              ? regs[ac->dyn[i].index]
+              : st[argPtr - ac->dyn[i].index];
+          a = DASH(ac->dyn[i].shared, a);
+          w[k] = a;
+          ht |= (a >> 32) << k;
+      }
+      if (ht & 1)
+          w[1] = setHT(w[1], getHT(w[0]));
+      w[0] = setHT(w[0], ht);
+      h++;
+      NEXT;
+  }
+
+op_app_sse2: {
+#ifdef __SSE2__
+      const AppCode *ac = pc[-1].u.ac;
+      __m128i v = _mm_or_si128(
+          _mm_loadu_si128((const __m128i *) ac->atom),
+          _mm_and_si128(
+              _mm_add_epi32(_mm_loadu_si128((const __m128i *) ac->id),
+                            _mm_set1_epi32(base << HT)),
+              _mm_loadu_si128((const __m128i *) ac->ptr)));
+      UInt ht = ac->ht;
+
+      w = hap[h].atom;
+      _mm_storeu_si128((__m128i *) w, v);
+      for (i = 0; i < ac->numDyn; ++i) {
+          Int k = ac->dyn[i].slot;
+          Atom a = ac->dyn[i].reg
+              ? regs[ac->dyn[i].index]
+              : st[argPtr - ac->dyn[i].index];
+          a = DASH(ac->dyn[i].shared, a);
+          w[k] = a;
+          ht |= (a >> 32) << k;
+      }
+      if (ht & 1)
+          w[1] = setHT(w[1], getHT(w[0]));
+      w[0] = setHT(w[0], ht);
+      h++;
+#endif
+      NEXT;
+  }
+
+op_app_avx2:
+#ifdef X86
+  instAppAVX2(hap[h].atom, pc[-1].u.ac, st + argPtr, regs, base << HT);
+  h++;
+#endif
+  NEXT;
+
+op_prs: {
+      Atom a = PRIMARG(pc[-1].atom);
+      Atom b = PRIMARG(pc[-1].atom2);
+
+      m->prsCandidateCount++;
+      if (isINT(a) && isINT(b) && !primFails(pc[-1].u.prim, b)) {
+          m->prsSuccessCount++;
+          regs[pc[-1].index] = ARITH(pc[-1].u.prim, a, b, b);
+      } else {
+          SAVE;
+          instPrimApp(m, base, argPtr, pc[-1].app);
+          LOAD;
+      }
+      NEXT;
+  }
+
+op_push:
+  st[d++] = pc[-1].atom;
+  NEXT;
+
+op_push_ptr:
+  st[d++] = mkPTR(pc[-1].shared, base + pc[-1].index);
+  NEXT;
+
+op_push_arg:
+  st[d] = DASH(pc[-1].shared, st[argPtr - pc[-1].index]);
+  d++;
+  NEXT;
+
+op_push_reg:
+  st[d++] = DASH(pc[-1].shared, regs[pc[-1].index]);
+  NEXT;
+
+op_slide:
+  /* As slide() */
+  for (i = spOld; i < d; i++)
+      st[i - pc[-1].index] = st[i];
+  d -= pc[-1].index;
+op_end:
+  s = d;
+  if (sampled) {
+      m->interpCycles += cycles() - sampled;
+      sampled = 0;
+  }
+  if (h > hLimit) goto gc;
+  STEP;
+
+op_select:
+  if (pc[-1].index) {
+      for (i = spOld; i < d; i++)
+          st[i - pc[-1].index] = st[i];
+      d -= pc[-1].index;
+  }
+  s = d;
+  if (sampled) {
+      m->interpCycles += cycles() - sampled;
+      sampled = 0;
+  }
+cmp_select: {
+      /* As r_int and r_con, if the operands are numbers and neither
+         step would be put off by a collection or an update */
+      Atom a = st[s-1], b = st[s-3], p = st[s-2];
+
+      prsSelects++;
+      if (isINT(a) && isINT(b) && h <= hLimit &&
+          !(u > 0 && 3 > s - us[u-1].saddr)) {
+          Prim pid = getPRIId(p);
+          Atom c = getPRISwap(p) ? ARITH(pid, b, a, b) : ARITH(pid, a, b, b);
+
+          s -= 2;
+          m->primCount++;
+          left--;
+          prsSelectHits++;
+          selects++;
+          top = mkFUN(1, 0, ls[--l] + getCONIndex(c));
+          st[s-1] = top;
+          goto r_fun;
+      }
+      if (h > hLimit) goto gc;
+      STEP;
+  }
+
+#undef SAVE
+#undef LOAD
+#undef NEXT
+#undef STEP
+#undef UPDATE_CHECK
+#undef DASH
+#undef PRIMARG
+}
+
+/* Parser for .red files */
+
+Int strToBool(Char *s)
+{
+  if (!strcmp(s, "True")) return 1;
+  if (!strcmp(s, "False")) return 0;
+  fail(RED_EPARSE, "Parse error: boolean expected; got %s", s);
+  return 0;
+}
+
+void strToPrim(Char *s, Prim *p, Bool *b)
+{
+  *b = 0;
+  if (!strcmp(s, "emit")) { *p = EMIT; return; }
+  if (!strcmp(s, "emitInt")) { *p = EMITINT; return; }
+  if (!strcmp(s, "(!)")) { *p = SEQ; return; }
+  if (!strncmp(s, "swap:", 5)) {
+    *b = 1;
+    s = s+5;
+  }
+  if (!strcmp(s, "(+)")) { *p = ADD; return; }
+  if (!strcmp(s, "(-)")) { *p = SUB; return; }
+  if (!strcmp(s, "(==)")) { *p = EQ; return; }
+  if (!strcmp(s, "(/=)")) { *p = NEQ; return; }
+  if (!strcmp(s, "(<=)")) { *p = LEQ; return; }
+  if (!strcmp(s, "(.&.)")) { *p = AND; return; }
+  if (!strcmp(s, "st32")) { *p = ST32; return; }
+  if (!strcmp(s, "ld32")) { *p = LD32; return; }
+  if (!strcmp(s, "(*)")) { *p = MUL; return; }
+  if (!strcmp(s, "(/)")) { *p = QUOT; return; }
+  if (!strcmp(s, "(%)")) { *p = REM; return; }
+  if (!strcmp(s, "(.|.)")) { *p = OR; return; }
+  if (!strcmp(s, "(.^.)")) { *p = XOR; return; }
+  if (!strcmp(s, "(.<<.)")) { *p = SHL; return; }
+  if (!strcmp(s, "(.>>.)")) { *p = SHR; return; }
+  fail(RED_EPARSE, "Parse error: unknown primitive %s", s);
+}
+
+Bool parseAtom(FILE *f, Atom* result)
+{
+  Char str[16];
+  Int v;
+  Int a, i;
+  Bool swap;
+  Prim p;
+
+  return (
+    (  fscanf(f, " INT%*[ (]%i)", &v) == 1
+    && perform(*result = mkINT(v))
+    )
+    ||
+    (  fscanf(f, " ARG %5s%*[ (]%i)", str, &i) == 2
+    && perform(*result = mkARG(strToBool(str), i))
+    )
+    ||
+    (  fscanf(f, " VAR %5s%*[ (]%i)", str, &i) == 2
+    && perform(*result = mkPTR(strToBool(str), i))
+    )
+    ||
+    (  fscanf(f, " REG %5s%*[ (]%i)", str, &i) == 2
+    && perform(*result = mkREG(strToBool(str), i))
+    )
+    ||
+    (  fscanf(f, " CON%*[ (]%i%*[ )(]%i)",
+         &a, &i) == 2
+    && perform(*result = mkCON(a,i))
+    )
+    ||
+    (  fscanf(f, " FUN %5s%*[ (]%i%*[ )(]%i)",
+         str, &a, &i) == 3
+    && perform(*result = mkFUN(strToBool(str), a, i))
+    )
+    ||
+    (  fscanf(f, " PRI%*[ (]%i%*[) ]\"%15[^\"]\"", &a, str)
+    && perform(strToPrim(str, &p, &swap))
+    && perform(*result = mkPRI(a, swap, p))
+    )
+  );
+}
+
+#define makeListParser(fun, p, elem)                                        \
+  Int fun(FILE *f, Int n, elem *xs)                                         \
+    {                                                                       \
+      Char c;                                                               \
+      Int i = 0;                                                            \
+      if (! (fscanf(f, " %c", &c) == 1 && c == '['))                        \
+        fail(RED_EPARSE, "Parse error: expecting '['");                     \
+      for (;;) {                                                            \
+        if (i >= n)                                                         \
+          fail(RED_EPARSE, "Parse error: list contains too many elements"); \
+        if (p(f, &xs[i])) i++;                                              \
+        if (fscanf(f, " %c", &c) == 1 && (c == ',' || c == ']')) {          \
+          if (c == ']') return i;                                           \
+        }                                                                   \
+        else fail(RED_EPARSE, "Parse error");                               \
+      }                                                                     \
+      return 0;                                                             \
+    }
+
+makeListParser(parseAtoms, parseAtom, Atom)
+
+Bool parseApp(FILE *f, App *app)
+{
+  Char str[16];
+  Bool success;
+  Atom atoms[APSIZE];
+  AppTag tag;
+  Bool nf = false;
+  Int info = 0, size;
+
+  success =
+    (  fscanf(f, " APP %5s ", str) == 1
+    && perform(tag = AP)
+    && perform(nf = strToBool(str))
+    )
+    ||
+    (  fscanf(f, " CASE %i ", &info) == 1
+    && perform(tag = CASE)
+    )
+    ||
+    (  fscanf(f, " PRIM %i ", &info) == 1
+    && perform(tag = PRIM)
+    );
+  if (!success) return 0;
+  size = parseAtoms(f, APSIZE, atoms);
+
+  if (tag == CASE || tag == PRIM)
+      assert(size < 4);
+
+  *app = mkApp(tag, size, nf, info, atoms);
+
+  return 1;
+}
+
+makeListParser(parseApps, parseApp, App)
+
+Bool parseLut(FILE *f, Int *i)
+{
+    return fscanf(f, " %i", i) == 1;
+}
+
+makeListParser(parseLuts, parseLut, Lut)
+
+Bool parseString(FILE *f, Int n, Char *str)
+{
+  Int i;
+  Char c;
+  if (fscanf(f, " \"") != 0)
+      return 0;
+
+  for (i = 0; ; i++) {
+    if (i >= n || fscanf(f, "%c", &c) != 1) return 0;
+    if (c == '"') {
+      str[i] = '\0';
+      return 1;
+    }
+    str[i] = c;
+  }
+}
+
+UInt addName(Program *prog, const Char *name)
+{
+  Int len = strlen(name) + 1;
+
+  if (prog->namesSize + len > prog->namesMax) {
+    prog->namesMax = 2*prog->namesMax + len + 4096;
+    prog->names = realloc(prog->names, prog->namesMax);
+    if (!prog->names) fail(RED_ENOMEM, "out of memory reading template names");
+  }
+  strcpy(prog->names + prog->namesSize, name);
+  prog->namesSize += len;
+  return prog->namesSize - len;
+}
+
+Bool parseTemplate(Program *prog, FILE *f, Template *t)
+{
+  Char c;
+  Char name[NAMELEN];
+  if (fscanf(f, " (") != 0)
+      return 0;
+  if (parseString(f, NAMELEN, name) == 0) return 0;
+  t->name = addName(prog, name);
+  if (fscanf(f, " ,%i,", &t->arity) != 1) return 0;
+  t->numLuts = parseLuts(f, MAXLUTS, t->luts);
+  if (!(fscanf(f, " %c", &c) == 1 && c == ',')) fail(RED_EPARSE, "Parse error");
+  t->numPushs = parseAtoms(f, MAXPUSH, t->pushs);
+  if (!(fscanf(f, " %c", &c) == 1 && c == ',')) fail(RED_EPARSE, "Parse error");
+  t->numApps = parseApps(f, MAXAPS, t->apps);
+  if (!(fscanf(f, " %c", &c) == 1 && c == ')')) fail(RED_EPARSE, "Parse error");
+  return 1;
+}
+
+Int parse(Program *prog, FILE *f, Int n)
+{
+  Int i = 0;
+  Template *ts = prog->code = calloc(n, sizeof(Template));
+
+  if (!ts) fail(RED_ENOMEM, "out of memory reading templates");
+
+  for (;;) {
+      if (i >= n) fail(RED_EPARSE, "Parse error: too many templates");
+    if (!parseTemplate(prog, f, &ts[i])) return i;
+    i++;
+  }
+}
+
+/* Program images
+
+   An image is the parsed program exactly as it is held in memory, so
+   start-up is a mmap() however many templates there are:
+
+     ImageHeader
+     Template[numTemplates]     (at offset templates)
+     Char[namesSize]            (at offset names, NUL terminated names)
+
+   Atoms and apps are packed as in red_atom.h.  The header records the
+   layout the image was written with; an emulator built with different
+   parameters refuses it rather than misreading it.  Images are
+   written with -o and recognised by their magic when loaded. */
+
+#define IMAGEMAGIC "REDIMG\0\1"
+
+typedef struct {
+    char magic[8];
+    UInt ht, apSize, maxPush, maxAps, maxLuts, templateSize;
+    UInt numTemplates, namesSize;
+    uint64_t templates, names;
+  } ImageHeader;
+
+static ImageHeader imageHeader(const Program *prog)
+{
+  ImageHeader h;
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, IMAGEMAGIC, sizeof h.magic);
+  h.ht = HT;
+  h.apSize = APSIZE;
+  h.maxPush = MAXPUSH;
+  h.maxAps = MAXAPS;
+  h.maxLuts = MAXLUTS;
+  h.templateSize = sizeof(Template);
+  h.numTemplates = prog->numTemplates;
+  h.namesSize = prog->namesSize;
+  h.templates = sizeof(ImageHeader);
+  h.names = h.templates + sizeof(Template) * prog->numTemplates;
+  return h;
+}
+
+Bool isImage(FILE *f)
+{
+  char magic[8];
+  Bool r = fread(magic, sizeof magic, 1, f) == 1 &&
+           memcmp(magic, IMAGEMAGIC, sizeof magic) == 0;
+
+  rewind(f);
+  return r;
+}
+
+void writeImage(const Program *prog, const char *file)
+{
+  ImageHeader h = imageHeader(prog);
+  FILE *f = fopen(file, "wb");
+
+  if (!f ||
+      fwrite(&h, sizeof h, 1, f) != 1 ||
+      fwrite(prog->code, sizeof(Template), prog->numTemplates, f) !=
+        prog->numTemplates ||
+      fwrite(prog->names, 1, prog->namesSize, f) != prog->namesSize ||
+      fclose(f) != 0)
+    fail(RED_EIO, "couldn't write image %s", file);
+}
+
+/* Templates from a file are checked before use, as the parser would,
+   and so is every atom the engines would otherwise trust: a FUN or
+   case table must name a template and a REG or PRIM destination a
+   register.  flite splits a template whose apps don't fit into parts,
+   each ending by calling the next ([FUN False 0 next]), and a VAR in a
+   part can reach the apps of the parts before and after it; so a VAR
+   offset must fall among the apps of its chain of parts. */
+
+static Int nextPart(const Program *prog, Int i)
+{
+  const Template *t = &prog->code[i];
+  Atom a = t->numPushs == 1 ? t->pushs[0] : 0;
+
+  return !isINT(a) && isFUN(a) && !getFUNOriginal(a) &&
+         getFUNId(a) > (UInt) i && getFUNId(a) < (UInt) prog->numTemplates
+         ? (Int) getFUNId(a) : -1;
+}
+
+static Bool validAtom(const Program *prog, Atom a, Int before, Int after)
+{
+  if (isINT(a) || isARG(a) || isCON(a)) return 1;
+  if (isPTR(a)) return getPTRId(a) >= -before && getPTRId(a) < after;
+  if (isFUN(a)) return getFUNId(a) < (UInt) prog->numTemplates;
+  if (isREG(a)) return getREGIndex(a) < MAXREGS;
+  if (isPRI(a)) return getPRIId(a) < LAST_PRIM;
+  return 0;
+}
+
+static Bool validApp(const Program *prog, App app, Int before, Int after)
+{
+  Atom last = app.atom[APSIZE-1];
+  Int i, size;
+
+  if (isAppCollected(app) || isLONG(last) ||
+      (isLUT(last) && getLUTIndex(last) >= (UInt) prog->numTemplates) ||
+      (isPRIM(last) && getPRIMDest(last) >= MAXREGS))
+    return 0;
+  size = getAppSize(app);
+  if (size > 1 && isINT(getAppAtom(app, 0)) && isINT(getAppAtom(app, 1)))
+    return 0;
+  for (i = 0; i < size; i++)
+    if (!validAtom(prog, getAppAtom(app, i), before, after)) return 0;
+  return 1;
+}
+
+void checkTemplates(const Program *prog, const char *file)
+{
+  Int n = prog->numTemplates, i, j, k, bad = -1;
+  Int *before, *after;
+
+  for (i = 0; i < n; i++) {
+    const Template *t = &prog->code[i];
+    if (t->name >= prog->namesSize || t->arity < 0 ||
+        t->numLuts < 0 || t->numLuts > MAXLUTS ||
+        t->numPushs < 0 || t->numPushs > MAXPUSH ||
+        t->numApps < 0 || t->numApps > MAXAPS)
+      fail(RED_EPARSE, "%s: corrupt template %d", file, i);
+    for (j = 0; j < t->numLuts; j++)
+      if (t->luts[j] < 0 || t->luts[j] >= n)
+        fail(RED_EPARSE, "%s: template %d: bad case table", file, i);
+  }
+
+  /* The apps built by the parts of a chain before and from each one */
+  before = calloc(n + 1, sizeof(Int));
+  after = calloc(n + 1, sizeof(Int));
+  if (!before || !after) fail(RED_ENOMEM, "out of memory checking %s", file);
+  for (i = 0; i < n; i++)
+    if ((k = nextPart(prog, i)) >= 0 &&
+        before[i] + prog->code[i].numApps > before[k])
+      before[k] = before[i] + prog->code[i].numApps;
+  for (i = n-1; i >= 0; i--)
+    after[i] = prog->code[i].numApps +
+               ((k = nextPart(prog, i)) >= 0 ? after[k] : 0);
+
+  for (i = 0; i < n && bad < 0; i++) {
+    const Template *t = &prog->code[i];
+    for (j = 0; j < t->numPushs; j++)
+      if (!validAtom(prog, t->pushs[j], before[i], after[i])) bad = i;
+    for (j = 0; j < t->numApps; j++)
+      if (!validApp(prog, t->apps[j], before[i], after[i])) bad = i;
+  }
+  free(before);
+  free(after);
+  if (bad >= 0) fail(RED_EPARSE, "%s: template %d: bad atom", file, bad);
+}
+
+void loadImage(Program *prog, const char *file)
+{
+  ImageHeader want = imageHeader(prog), h;
+  struct stat st;
+  char *base;
+  Int fd;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    fail(RED_EIO, "couldn't open image %s: %s", file, strerror(errno));
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof h) {
+    close(fd);
+    fail(RED_EPARSE, "%s: truncated image", file);
+  }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    fail(RED_EIO, "couldn't map image %s: %s", file, strerror(errno));
+  prog->image = base;
+  prog->imageSize = st.st_size;
+
+  memcpy(&h, base, sizeof h);
+  if (h.ht != want.ht || h.apSize != want.apSize ||
+      h.maxPush != want.maxPush || h.maxAps != want.maxAps ||
+      h.maxLuts != want.maxLuts || h.templateSize != want.templateSize)
+    fail(RED_EPARSE, "%s: image was written for a different emulator layout", file);
+  if (h.numTemplates > MAXTEMPLATES)
+    fail(RED_EPARSE, "%s: too many templates", file);
+  if (h.templates != sizeof h ||
+      h.names != h.templates + (uint64_t) h.templateSize * h.numTemplates ||
+      h.names + h.namesSize != st.st_size ||
+      h.namesSize == 0 || base[st.st_size - 1] != '\0')
+    fail(RED_EPARSE, "%s: corrupt image", file);
+
+  prog->numTemplates = h.numTemplates;
+  prog->namesSize = h.namesSize;
+  prog->code = (Template *) (base + h.templates);
+  prog->names = base + h.names;
+  checkTemplates(prog, file);
+}
+
+/* Parse the .red text in f, closing it (unless it's stdin) before
+   passing an error on to a caller that catches it */
+
+static void parseFile(Program *prog, FILE *f)
+{
+  jmp_buf handler, *outer = errorHandler;
+
+  if (outer) {
+      errorHandler = &handler;
+      if (setjmp(handler)) {
+          errorHandler = outer;
+          if (f != stdin) fclose(f);
+          longjmp(*outer, 1);
+      }
+  }
+  prog->numTemplates = parse(prog, f, MAXTEMPLATES);
+  errorHandler = outer;
+  if (f != stdin) fclose(f);
+}
+
+/* Load a .red file or image ("-" is a .red file on stdin) */
+
+void loadProgram(Program *prog, const char *file)
+{
+  FILE *f;
+  double start = now();
+
+  memset(prog, 0, sizeof *prog);
+  if (strcmp(file, "-") == 0)
+      f = stdin;
+  else
+      f = fopen(file, "r");
+
+  if (!f)
+      fail(RED_EIO, "%s: %s", file, strerror(errno));
+
+  if (f != stdin && isImage(f)) {
+      fclose(f);
+      loadImage(prog, file);
+  } else
+      parseFile(prog, f);
+  if (prog->numTemplates <= 0) fail(RED_EPARSE, "No templates were parsed!");
+  prog->loadTime = now() - start;
+}
+
+/* A .red program held in memory, as red2c builds it in */
+
+void loadSource(Program *prog, const char *text)
+{
+  FILE *f = fmemopen((void *) text, strlen(text), "r");
+  double start = now();
+
+  memset(prog, 0, sizeof *prog);
+  if (!f)
+      fail(RED_EIO, "built-in program: %s", strerror(errno));
+  parseFile(prog, f);
+  if (prog->numTemplates <= 0) fail(RED_EPARSE, "No templates were parsed!");
+  prog->loadTime = now() - start;
+}
+
+void freeProgram(Program *prog)
+{
+  if (prog->image)
+      munmap(prog->image, prog->imageSize);
+  else {
+      free(prog->code);
+      free(prog->names);
+  }
+}
+
+/* Sizes given on the command line or in the environment */
+
+Int parseSize(const char *s, const char *what, Int min, Int max)
+{
+  char *end;
+  long n = strtol(s, &end, 0);
+
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+  }
+  if (*end != '\0' || n < min || n > max)
+    error("invalid %s size %s (must be between %d and %d)", what, s, min, max);
+  return n;
+}
+
+void sizeFromEnv(const char *var, const char *what, Int min, Int max, Int *size)
+{
+  const char *s = getenv(var);
+
+  if (s && *s) *size = parseSize(s, what, min, max);
+}
+
+/* Machines
+
+   A machine is created from a configuration (a Machine with only the
+   sizes and options filled in) and can be reset to run program after
+   program, as the workers of a batch do. */
+
+void defaultConfig(Machine *config)
+{
+  memset(config, 0, sizeof *config);
+  config->maxHeapApps    = DEFHEAPAPPS;
+  config->maxStackElems  = DEFSTACKELEMS;
+  config->maxUStackElems = DEFUSTACKELEMS;
+  config->maxLStackElems = DEFLSTACKELEMS;
+  config->heapLimit      = MAXHEAPLIMIT;
+  config->cacheLines     = DEFCACHELINES;
+  config->engine         = dispatch;
+  config->out            = stdout;
+  config->flushInterval  = -1;
+}
+
+/* Make the sizes of a configuration consistent */
+
+void checkConfig(Machine *config)
+{
+  if (config->maxHeapApps > config->heapLimit)
+      config->maxHeapApps = config->heapLimit;
+  if (config->maxHeapApps < 4*config->nurseryApps) {
+      if (4*config->nurseryApps > config->heapLimit)
+          error("nursery of %d apps too big for heap limit %d",
+                config->nurseryApps, config->heapLimit);
+      config->maxHeapApps = 4*config->nurseryApps;
+  }
+  if (config->maxHeapApps < 2*HEAPMARGIN ||
+      config->maxStackElems < 2*STACKMARGIN ||
+      config->maxUStackElems < 2*STACKMARGIN ||
+      config->maxLStackElems < 2*STACKMARGIN)
+      error("heap or stack too small");
+  if (config->cacheLines & (config->cacheLines - 1))
+      error("heap cache of %d lines isn't a power of two",
+            config->cacheLines);
+}
+
+/* Allocate a machine for config into *mp, so that it can be freed
+   even if allocation fails part way */
+
+void newMachine(const Machine *config, Machine **mp)
+{
+  Machine *m = malloc(sizeof *m);
+
+  if (!m) fail(RED_ENOMEM, "out of memory allocating the machine");
+  *m = *config;
+  m->initialHeapApps = m->maxHeapApps;
+  *mp = m;
+  alloc(m);
+}
+
+void freeMachine(Machine *m)
+{
+  release(m);
+  free(m);
+}
+
+/* Ready m to run prog from the start, shrinking the heap back to its
+   configured size if the last run grew it */
+
+void resetMachine(Machine *m, const Program *prog)
+{
+  if (m->maxHeapApps != m->initialHeapApps || m->mappedHeap) {
+    freeHeapArray(m, m->heap);
+    freeHeapArray(m, m->heap2);
+    m->maxHeapApps = m->initialHeapApps;
+    m->heap = (App*) malloc(sizeof(App) * m->maxHeapApps);
+    m->heap2 = (App*) malloc(sizeof(App) * m->maxHeapApps);
+    if (!m->heap || !m->heap2)
+      fail(RED_ENOMEM, "out of memory allocating the heap");
+  }
+  if (m->code != prog->code)
+    freeDecoded(m);
+  m->prog = prog;
+  m->code = prog->code;
+  m->names = prog->names;
+  m->numTemplates = prog->numTemplates;
+  m->tickLimit = LLONG_MAX;
+  if (m->engine == dispatchProfiled)
+    newProfile(m);
+  if (m->censusFile)
+    newCensus(m);
+  openDevices(m);
+  if (m->asyncSerial && !m->tracingEnabled)
+    startSerial(m);
+  init(m);
+}
+
+/* Run m until the program finishes, runs out of input or has used up
+   its ticks to tickLimit */
+
+RedStatus run(Machine *m)
+{
+  double start = now();
+  RedStatus status = RED_HALTED;
+
+  runningMachine = m;
+  if (!setjmp(m->halt))
+    status = m->engine(m) ? RED_OK : RED_BUDGET;
+  runningMachine = NULL;
+  syncOutput(m);
+  m->runTime += now() - start;
+  return m->status = status;
+}
+
+void reportProfile(Machine *m)
+{
+  if (m->census) {
+    displayCensus(m);
+    if (fclose(m->census->f) != 0)
+      fail(RED_EIO, "%s: %s", m->censusFile, strerror(errno));
+    m->census->f = NULL;
+  }
+  if (!m->prof) return;
+  displayProfile(m);
+  if (m->foldedFile)
+    writeFolded(m, m->foldedFile);
+}
+
+void report(Machine *m, Bool verbose)
+{
+  FILE *f = m->out;
+  Long n = ticks(m);
+
+  if (!verbose) {
+      fprintf(f, "%d\n", getINTValue(m->stack[0]));
+      reportProfile(m);
+      return;
+  }
+
+  fprintf(f, "\n==== EXECUTION REPORT ====\n");
+  fprintf(f, "Result      = %12i\n", getINTValue(m->stack[0]));
+  fprintf(f, "Ticks       = %12lld\n", n);
+  fprintf(f, "Swap        = %11.1f%%\n", (100.0*m->swapCount)/n);
+  fprintf(f, "Prim        = %11.1f%%\n", (100.0*m->primCount)/n);
+  fprintf(f, "Unwind      = %11.1f%%\n", (100.0*m->unwindCount)/n);
+  fprintf(f, "Update      = %11.1f%%\n", (100.0*m->updateCount)/n);
+  fprintf(f, "Apply       = %11.1f%%\n", (100.0*m->applyCount)/n);
+  fprintf(f, "PRS Success = %11.1f%%\n",
+          (100.0*m->prsSuccessCount)/(1+m->prsCandidateCount));
+  if (m->cache)
+      fprintf(f, "Heap cache  = %11.1f%% hits %12lld misses %12lld write-backs\n",
+              (100.0*m->cacheHits)/(1+m->cacheHits+m->cacheMisses),
+              m->cacheMisses, m->cacheWriteBacks);
+  if (m->engine == dispatchThreaded) {
+      fprintf(f, "App kernel  = %12s\n", kernelNames[appKernel]);
+      fprintf(f, "PRS select  = %11.1f%% of %lld applications of %d "
+              "templates selecting on a comparison\n",
+              (100.0*m->prsSelectHits)/(1+m->prsSelectCount),
+              m->prsSelectCount, m->selectTemplates);
+  }
+  if (m->jitState)
+      fprintf(f, "%-11s = %11.1f%% of applications %5.1f%% of apply "
+              "time (sampled) %d templates %zu bytes\n",
+              m->nativeCode ? "red2c" : "JIT",
+              (100.0*m->jitApplyCount)/(1+m->applyCount),
+              (100.0*m->jitCycles)/(1+m->jitCycles+m->interpCycles),
+              m->jitState->compiled, m->jitState->used);
+  if (m->squeeze)
+      fprintf(f, "Squeezed    = %12lld update frames\n", m->squeezed);
+  fprintf(f, "#GCs        = %12d\n", m->gcCount);
+  if (m->nurseryApps)
+      fprintf(f, "Minor GCs   = %12d %9.3fs %12lld bytes copied\n",
+              m->minorCount, m->minorTime, m->minorCopied);
+  fprintf(f, "Major GCs   = %12d %9.3fs %12lld bytes copied\n",
+          m->majorCount, m->majorTime, m->majorCopied);
+  fprintf(f, "Max Heap    = %12d\n", m->maxLive);
+  fprintf(f, "Heap Size   = %12d\n", m->maxHeapApps);
+  fprintf(f, "Parse time  = %12.3f ms\n", m->prog->loadTime * 1e3);
+  fprintf(f, "Run time    = %12.3f ms\n", m->runTime * 1e3);
+  fprintf(f, "Reduce time = %12.3f ms %5.1f%%\n",
+          (m->runTime - m->gcTime) * 1e3,
+          (100.0*(m->runTime - m->gcTime))/m->runTime);
+  fprintf(f, "GC time     = %12.3f ms %5.1f%%\n", m->gcTime * 1e3,
+          (100.0*m->gcTime)/m->runTime);
+  if (m->gcCycles)
+      fprintf(f, "GC cycles   = %12lld\n", m->gcCycles);
+  displayHist(f, "GC pauses (us)", m->pauseHist);
+  displayHist(f, "GC survivors (apps)", m->survivorHist);
+  fprintf(f, "==========================\n");
+  reportProfile(m);
+}
+
+/* Snapshots
+
+   A snapshot is the whole state of a machine between two steps, taken
+   with -k at -K ticks or on SIGUSR1, and resumed with -r in place of
+   the program:
+
+     SnapshotHeader             (the program's ImageHeader within)
+     Template[numTemplates], Char[namesSize]    as in an image
+     the stacks, registers, remembered set and call counts
+     App[maxHeapApps]           (at offset heap, SNAPALIGN aligned)
+
+   The sizes of the heap and stacks come from the snapshot, and the
+   heap is used where it is mapped, so resuming costs little more than
+   an image however big the heap is.  Serial input and devices
+   aren't saved: a resumed program reads on from whatever input it is
+   given and gets its devices afresh.  Profiles
+   and censuses start afresh. */
+
+#define SNAPMAGIC "REDSNAP\3"
+#define SNAPALIGN 65536                 // mmap() with any page size
+
+typedef struct {
+    char magic[8];
+    ImageHeader image;                  // offsets from the file start
+    UInt appSize, updateSize;
+    Int maxHeapApps, heapLimit, nurseryApps, nurseryBase, oldTop;
+    Int maxStackElems, maxUStackElems, maxLStackElems;
+    Int hp, sp, usp, lsp, numRemembered;
+    Int gcCount, minorCount, majorCount, maxLive;
+    Long swapCount, primCount, applyCount, unwindCount, updateCount,
+         selectCount, prsCandidateCount, prsSuccessCount;
+    Long minorCopied, majorCopied, squeezed;
+    uint64_t stack, ustack, lstack, registers, remembered, calls, heap;
+    uint64_t size;
+  } SnapshotHeader;
+
+static uint64_t snapSection(uint64_t *end, uint64_t size, uint64_t align)
+{
+  uint64_t off = (*end + align-1) & ~(align-1);
+
+  *end = off + size;
+  return off;
+}
+
+static SnapshotHeader snapshotHeader(const Machine *m)
+{
+  SnapshotHeader h;
+  uint64_t end;
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, SNAPMAGIC, sizeof h.magic);
+  h.image = imageHeader(m->prog);
+  h.image.templates = sizeof h;
+  h.image.names = h.image.templates + sizeof(Template) * m->numTemplates;
+  h.appSize = sizeof(App);
+  h.updateSize = sizeof(Update);
+
+  h.maxHeapApps = m->maxHeapApps;
+  h.heapLimit = m->heapLimit;
+  h.nurseryApps = m->nurseryApps;
+  h.nurseryBase = m->nurseryBase;
+  h.oldTop = m->oldTop;
+  h.maxStackElems = m->maxStackElems;
+  h.maxUStackElems = m->maxUStackElems;
+  h.maxLStackElems = m->maxLStackElems;
+  h.hp = m->hp;
+  h.sp = m->sp;
+  h.usp = m->usp;
+  h.lsp = m->lsp;
+  h.numRemembered = m->numRemembered;
+  h.gcCount = m->gcCount;
+  h.minorCount = m->minorCount;
+  h.majorCount = m->majorCount;
+  h.maxLive = m->maxLive;
+  h.swapCount = m->swapCount;
+  h.primCount = m->primCount;
+  h.applyCount = m->applyCount;
+  h.unwindCount = m->unwindCount;
+  h.updateCount = m->updateCount;
+  h.selectCount = m->selectCount;
+  h.prsCandidateCount = m->prsCandidateCount;
+  h.prsSuccessCount = m->prsSuccessCount;
+  h.minorCopied = m->minorCopied;
+  h.majorCopied = m->majorCopied;
+  h.squeezed = m->squeezed;
+
+  end = h.image.names + h.image.namesSize;
+  h.stack = snapSection(&end, sizeof(Atom) * h.sp, 8);
+  h.ustack = snapSection(&end, sizeof(Update) * h.usp, 8);
+  h.lstack = snapSection(&end, sizeof(Lut) * h.lsp, 8);
+  h.registers = snapSection(&end, sizeof(Atom) * MAXREGS, 8);
+  h.remembered = snapSection(&end, sizeof(Int) * h.numRemembered, 8);
+  h.calls = snapSection(&end, sizeof(ProfEntry) * m->numTemplates, 8);
+  h.heap = snapSection(&end, sizeof(App) * h.maxHeapApps, SNAPALIGN);
+  h.size = end;
+  return h;
+}
+
+static Bool writeSection(FILE *f, uint64_t off, const void *p, size_t size)
+{
+  return fseeko(f, off, SEEK_SET) == 0 && (!size || fwrite(p, size, 1, f) == 1);
+}
+
+/* Written to a temporary file and renamed, so that an earlier snapshot
+   survives a failed write */
+
+void writeSnapshot(Machine *m, const char *file)
+{
+  SnapshotHeader h;
+  char *tmp = malloc(strlen(file) + 5);
+  FILE *f = NULL;
+  Bool ok;
+
+  unsqueezeUStack(m);
+  h = snapshotHeader(m);
+  if (!tmp) fail(RED_ENOMEM, "out of memory");
+  sprintf(tmp, "%s.tmp", file);
+  flushCache(m, 0);
+  ok = (f = fopen(tmp, "wb")) &&
+       writeSection(f, 0, &h, sizeof h) &&
+       writeSection(f, h.image.templates, m->code,
+                    sizeof(Template) * m->numTemplates) &&
+       writeSection(f, h.image.names, m->names, h.image.namesSize) &&
+       writeSection(f, h.stack, m->stack, sizeof(Atom) * h.sp) &&
+       writeSection(f, h.ustack, m->ustack, sizeof(Update) * h.usp) &&
+       writeSection(f, h.lstack, m->lstack, sizeof(Lut) * h.lsp) &&
+       writeSection(f, h.registers, m->registers, sizeof(Atom) * MAXREGS) &&
+       writeSection(f, h.remembered, m->remembered,
+                    sizeof(Int) * h.numRemembered) &&
+       writeSection(f, h.calls, m->profTable,
+                    sizeof(ProfEntry) * m->numTemplates) &&
+       writeSection(f, h.heap, m->heap, sizeof(App) * h.maxHeapApps);
+  if (f && fclose(f) != 0) ok = 0;
+  if (!ok || rename(tmp, file) != 0) {
+    remove(tmp);
+    free(tmp);
+    fail(RED_EIO, "couldn't write snapshot %s", file);
+  }
+  free(tmp);
+}
+
+static Bool inSnapshot(const SnapshotHeader *h, uint64_t off, uint64_t size)
+{
+  return off <= h->size && size <= h->size - off;
+}
+
+/* Map a snapshot, its program into prog and its sizes into config */
+
+void loadSnapshot(Program *prog, Machine *config, const char *file)
+{
+  SnapshotHeader h;
+  ImageHeader want;
+  struct stat st;
+  char *base;
+  double start = now();
+  Int fd;
+
+  memset(prog, 0, sizeof *prog);
+  want = imageHeader(prog);
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    fail(RED_EIO, "couldn't open snapshot %s: %s", file, strerror(errno));
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof h) {
+    close(fd);
+    fail(RED_EPARSE, "%s: truncated snapshot", file);
+  }
+  /* Private and writable: the heap is run in place */
+  base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    fail(RED_EIO, "couldn't map snapshot %s: %s", file, strerror(errno));
+  prog->image = base;
+  prog->imageSize = st.st_size;
+
+  memcpy(&h, base, sizeof h);
+  if (memcmp(h.magic, SNAPMAGIC, sizeof h.magic) != 0)
+    fail(RED_EPARSE, "%s: not a snapshot", file);
+  if (h.image.ht != want.ht || h.image.apSize != want.apSize ||
+      h.image.maxPush != want.maxPush || h.image.maxAps != want.maxAps ||
+      h.image.maxLuts != want.maxLuts ||
+      h.image.templateSize != want.templateSize ||
+      h.appSize != sizeof(App) || h.updateSize != sizeof(Update))
+    fail(RED_EPARSE, "%s: snapshot was written for a different emulator layout", file);
+  if (h.size != st.st_size ||
+      h.image.numTemplates == 0 || h.image.numTemplates > MAXTEMPLATES ||
+      !inSnapshot(&h, h.image.templates,
+                  (uint64_t) sizeof(Template) * h.image.numTemplates) ||
+      h.image.namesSize == 0 ||
+      !inSnapshot(&h, h.image.names, h.image.namesSize) ||
+      base[h.image.names + h.image.namesSize - 1] != '\0' ||
+      h.maxHeapApps < 2*HEAPMARGIN || h.maxHeapApps > h.heapLimit ||
+      h.heapLimit > MAXHEAPLIMIT ||
+      h.nurseryApps < 0 || h.oldTop < 0 || h.oldTop > h.nurseryBase ||
+      h.nurseryBase > h.maxHeapApps || h.hp < 0 || h.hp > h.maxHeapApps ||
+      h.maxStackElems < 2*STACKMARGIN || h.sp < 1 || h.sp > h.maxStackElems ||
+      h.maxUStackElems < 2*STACKMARGIN || h.usp < 0 ||
+      h.usp > h.maxUStackElems ||
+      h.maxLStackElems < 2*STACKMARGIN || h.lsp < 0 ||
+      h.lsp > h.maxLStackElems || h.numRemembered < 0 ||
+      !inSnapshot(&h, h.stack, (uint64_t) sizeof(Atom) * h.sp) ||
+      !inSnapshot(&h, h.ustack, (uint64_t) sizeof(Update) * h.usp) ||
+      !inSnapshot(&h, h.lstack, (uint64_t) sizeof(Lut) * h.lsp) ||
+      !inSnapshot(&h, h.registers, sizeof(Atom) * MAXREGS) ||
+      !inSnapshot(&h, h.remembered, (uint64_t) sizeof(Int) * h.numRemembered) ||
+      !inSnapshot(&h, h.calls,
+                  (uint64_t) sizeof(ProfEntry) * h.image.numTemplates) ||
+      h.heap % SNAPALIGN != 0 ||
+      !inSnapshot(&h, h.heap, (uint64_t) sizeof(App) * h.maxHeapApps))
+    fail(RED_EPARSE, "%s: corrupt snapshot", file);
+
+  prog->numTemplates = h.image.numTemplates;
+  prog->namesSize = h.image.namesSize;
+  prog->code = (Template *) (base + h.image.templates);
+  prog->names = base + h.image.names;
+  checkTemplates(prog, file);
+  prog->loadTime = now() - start;
+
+  config->maxHeapApps = h.maxHeapApps;
+  config->heapLimit = h.heapLimit;
+  config->nurseryApps = h.nurseryApps;
+  config->maxStackElems = h.maxStackElems;
+  config->maxUStackElems = h.maxUStackElems;
+  config->maxLStackElems = h.maxLStackElems;
+}
+
+/* Put m, just reset to run the program of a snapshot loaded by
+   loadSnapshot(), in the state the snapshot was taken in.  The heap
+   is the one in the mapping, so only one machine can be restored from
+   a loaded snapshot. */
+
+void restoreMachine(Machine *m)
+{
+  const char *base = m->prog->image;
+  const Int *remembered;
+  SnapshotHeader h;
+  Int i;
+
+  memcpy(&h, base, sizeof h);
+  m->nurseryBase = h.nurseryBase;
+  m->oldTop = h.oldTop;
+  m->hp = h.hp;
+  m->sp = h.sp;
+  m->usp = h.usp;
+  m->lsp = h.lsp;
+  memcpy(m->stack, base + h.stack, sizeof(Atom) * h.sp);
+  memcpy(m->ustack, base + h.ustack, sizeof(Update) * h.usp);
+  memcpy(m->lstack, base + h.lstack, sizeof(Lut) * h.lsp);
+  memcpy(m->registers, base + h.registers, sizeof(Atom) * MAXREGS);
+  memcpy(m->profTable, base + h.calls, sizeof(ProfEntry) * m->numTemplates);
+  remembered = (const Int *) (base + h.remembered);
+  for (i = 0; i < h.numRemembered; i++)
+    remember(m, remembered[i]);
+
+  m->gcCount = h.gcCount;
+  m->minorCount = h.minorCount;
+  m->majorCount = h.majorCount;
+  m->maxLive = h.maxLive;
+  m->swapCount = h.swapCount;
+  m->primCount = h.primCount;
+  m->applyCount = h.applyCount;
+  m->unwindCount = h.unwindCount;
+  m->updateCount = h.updateCount;
+  m->selectCount = h.selectCount;
+  m->prsCandidateCount = h.prsCandidateCount;
+  m->prsSuccessCount = h.prsSuccessCount;
+  m->minorCopied = h.minorCopied;
+  m->majorCopied = h.majorCopied;
+  m->squeezed = h.squeezed;
+
+  freeHeapArray(m, m->heap);
+  m->heap = m->mappedHeap = (App *) (base + h.heap);
+
+  /* The cost-centre stacks of the frames are lost: charge to the root */
+  if (m->prof) {
+    for (i = 0; i < m->usp; i++) m->ustack[i].ccs = m->prof->cur;
+    for (i = 0; i < m->lsp; i++) m->prof->lccs[i] = m->prof->cur;
+  }
+}
+
+#define SNAPSLICE (1 << 20)             // ticks between looks for SIGUSR1
+
+static volatile sig_atomic_t snapshotWanted;
+
+static void onSnapshotSignal(int sig)
+{
+  snapshotWanted = 1;
+}
+
+/* Run m as run() does, writing a snapshot to file when it reaches at
+   ticks and whenever SIGUSR1 arrives */
+
+RedStatus runSnapshotting(Machine *m, const char *file, Long at)
+{
+  struct sigaction sa;
+  RedStatus status;
+  Long next;
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = onSnapshotSignal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  if (at <= ticks(m)) at = LLONG_MAX;
+  for (;;) {
+    next = ticks(m) + SNAPSLICE;
+    m->tickLimit = at < next ? at : next;
+    if ((status = run(m)) != RED_BUDGET)
+      return status;
+    if (ticks(m) >= at || snapshotWanted) {
+      snapshotWanted = 0;
+      if (ticks(m) >= at) at = LLONG_MAX;
+      writeSnapshot(m, file);
+      fprintf(stderr, "%s: snapshot at %lld ticks written to %s\n",
+              program_name, ticks(m), file);
+    }
+  }
+}
+
+/* Residual programs
+
+   With -x, the machine stops at -K ticks and writes the rest of the
+   run as a .red program: any Reduceron, in particular the RTL built
+   from it by fpga/Red -v, then carries on from there, having only the
+   remaining steps to simulate.  The templates are kept, main moving
+   to the end, and new templates ("resume", from index 0 on) build the
+   live heap two apps at a time, with VAR offsets reaching back and
+   forward from each template's base, so any graph can be rebuilt as
+   long as allocation doesn't stop for a collection on the way (their
+   FUN atoms aren't original, which keeps the collector out).  The
+   last one pushes a pointer to a chain of apps that, unwound, puts
+   back the case stack, the stack and, through the shared pointers to
+   the apps under evaluation, the update frames:
+
+     - A CASE app of one atom for each case table, oldest first.
+
+     - The stack below the first update frame, three atoms to an app
+       (the fourth pointing on), topped with a shared pointer to the
+       app of the first frame.
+
+     - The app of each frame, overwritten with the stack between it
+       and the next frame in the same way.  Only the last ends with
+       the top of the stack.
+
+   Chains longer than one app under a frame come back with extra
+   update frames, which cost a few updates but change no result.
+   Serial input read ahead and the contents of devices aren't carried
+   over. */
+
+typedef struct {
+    Machine *m;
+    Int *slot;                          // new address by heap address, or -1
+    Int *todo, numTodo;
+    CacheLine *apps;
+    Int numApps, maxApps;
+} Residual;
+
+static Int newSlot(Residual *r)
+{
+  if (r->numApps == r->maxApps) {
+    r->maxApps = r->maxApps ? 2*r->maxApps : 1024;
+    r->apps = realloc(r->apps, sizeof(CacheLine) * r->maxApps);
+    if (!r->apps) fail(RED_ENOMEM, "out of memory writing residual program");
+  }
+  memset(&r->apps[r->numApps], 0, sizeof(CacheLine));
+  r->apps[r->numApps].tag = AP;
+  return r->numApps++;
+}
+
+/* a with its pointer (if any) moved to the new heap */
+
+static Atom residualAtom(Residual *r, Atom a)
+{
+  Int addr;
+
+  if (!isPTR(a)) return a;
+  addr = getPTRId(a);
+  if (r->slot[addr] < 0) {
+    r->slot[addr] = newSlot(r);
+    r->todo[r->numTodo++] = addr;
+  }
+  return mkPTR(getPTRShared(a), r->slot[addr]);
+}
+
+/* The n atoms at xs, xs[n-1] on top, as a chain of apps from slot s */
+
+static void chainApps(Residual *r, Int s, const Atom *xs, Int n)
+{
+  Int i, k = n <= APSIZE ? n : APSIZE-1;
+  Atom next = mkINV();
+
+  if (n > APSIZE)
+    next = mkPTR(0, newSlot(r));
+  r->apps[s].tag = AP;
+  r->apps[s].nf = 0;
+  r->apps[s].size = 0;
+  if (n > APSIZE)
+    r->apps[s].atom[r->apps[s].size++] = next;
+  for (i = k-1; i >= 0; i--) {
+    Atom a = residualAtom(r, xs[i]);   // r->apps may move
+    r->apps[s].atom[r->apps[s].size++] = a;
+  }
+  if (n > APSIZE)
+    chainApps(r, getPTRId(next), xs+k, n-k);
+}
+
+/* The stack from base to end, topped with the app of frame f if f < usp */
+
+static void chainSegment(Residual *r, Int s, Int base, Int end, Int f)
+{
+  Machine *m = r->m;
+  Atom *xs;
+  Int n = end-base;
+
+  if (n < 0)
+    fail(RED_EINVALID, "update frames out of order at %d", base);
+  if (!(xs = malloc(sizeof(Atom) * (n+1))))
+    fail(RED_ENOMEM, "out of memory writing residual program");
+  memcpy(xs, &m->stack[base], sizeof(Atom) * n);
+  if (f < m->usp)
+    xs[n++] = mkPTR(1, m->ustack[f].haddr);
+  chainApps(r, s, xs, n);
+  free(xs);
+}
+
+static Atom movedMain(const Machine *m, Atom a)
+{
+  if (isFUN(a) && getFUNId(a) == 0)
+    return mkFUN(getFUNOriginal(a), getFUNArity(a), m->numTemplates);
+  return a;
+}
+
+/* Negative numbers in parentheses, as Haskell's read (fpga/Red) wants */
+
+static const char *redInt(char *buf, Int n)
+{
+  sprintf(buf, n < 0 ? "(%d)" : "%d", n);
+  return buf;
+}
+
+static void writeRedAtom(FILE *f, const Machine *m, Atom a, Int base)
+{
+  char buf[16];
+
+  a = movedMain(m, a);
+  if (isINT(a))
+    fprintf(f, "INT %s", redInt(buf, getINTValue(a)));
+  else if (isPTR(a))
+    fprintf(f, "VAR %s %s", getPTRShared(a) ? "True" : "False",
+            redInt(buf, getPTRId(a) - base));
+  else if (isARG(a))
+    fprintf(f, "ARG %s %u", getARGShared(a) ? "True" : "False",
+            getARGIndex(a));
+  else if (isREG(a))
+    fprintf(f, "REG %s %u", getREGShared(a) ? "True" : "False",
+            getREGIndex(a));
+  else if (isCON(a))
+    fprintf(f, "CON %u %u", getCONArity(a), getCONIndex(a));
+  else if (isFUN(a))
+    fprintf(f, "FUN %s %u %u", getFUNOriginal(a) ? "True" : "False",
+            getFUNArity(a), getFUNId(a));
+  else if (isPRI(a) && getPRIId(a) < LAST_PRIM)
+    fprintf(f, "PRI %u \"%s%s\"", getPRIArity(a),
+            getPRISwap(a) ? "swap:" : "", primNames[getPRIId(a)]);
+  else
+    fail(RED_EINVALID, "can't write atom %llx", (unsigned long long) a);
+}
+
+static void writeRedApp(FILE *f, const Machine *m, const CacheLine *c,
+                        Int base)
+{
+  Int i;
+
+  if (c->tag == CASE)
+    fprintf(f, "CASE %d [", c->info);
+  else if (c->tag == PRIM)
+    fprintf(f, "PRIM %d [", c->info);
+  else
+    fprintf(f, "APP %s [", c->nf ? "True" : "False");
+  for (i = 0; i < c->size; i++) {
+    if (i) fputc(',', f);
+    writeRedAtom(f, m, c->atom[i], base);
+  }
+  fputc(']', f);
+}
+
+static void writeRedTemplate(FILE *f, const Machine *m, const Template *t)
+{
+  CacheLine c;
+  Int i;
+
+  fprintf(f, "(\"%s\",%d,[", m->names + t->name, t->arity);
+  for (i = 0; i < t->numLuts; i++)
+    fprintf(f, "%s%d", i ? "," : "", t->luts[i]);
+  fputs("],[", f);
+  for (i = 0; i < t->numPushs; i++) {
+    if (i) fputc(',', f);
+    writeRedAtom(f, m, t->pushs[i], 0);
+  }
+  fputs("],[", f);
+  for (i = 0; i < t->numApps; i++) {
+    if (i) fputc(',', f);
+    unpackApp(&c, &t->apps[i]);
+    writeRedApp(f, m, &c, 0);
+  }
+  fputs("])\n", f);
+}
+
+/* Builder j allocates new apps 2j and 2j+1 and goes on to the next,
+   numbered as laid out above */
+
+static void writeBuilder(FILE *f, const Machine *m, const Residual *r,
+                         Int j, Int entry)
+{
+  Int base = 2*j, numBuilders = (r->numApps+1)/2, i;
+  char buf[16];
+
+  if (j == 0)
+    fputs("(\"resume\",0,[],[", f);
+  else
+    fprintf(f, "(\"resume#%d\",0,[],[", j);
+  if (j+1 < numBuilders)
+    fprintf(f, "FUN False 0 %d", m->numTemplates + j+1);
+  else
+    fprintf(f, "VAR False %s", redInt(buf, entry - base));
+  fputs("],[", f);
+  for (i = base; i < base+2 && i < r->numApps; i++) {
+    if (i > base) fputc(',', f);
+    writeRedApp(f, m, &r->apps[i], base);
+  }
+  fputs("])\n", f);
+}
+
+void writeResidual(Machine *m, const char *file)
+{
+  Residual r;
+  Int entry, prev, i, j, k, s;
+  FILE *f;
+
+  memset(&r, 0, sizeof r);
+  r.m = m;
+  r.slot = malloc(sizeof(Int) * m->maxHeapApps);
+  r.todo = malloc(sizeof(Int) * m->maxHeapApps);
+  if (!r.slot || !r.todo)
+    fail(RED_ENOMEM, "out of memory writing residual program");
+  for (i = 0; i < m->maxHeapApps; i++) r.slot[i] = -1;
+  flushCache(m, 0);
+  unsqueezeUStack(m);
+
+  /* The case tables, then the stack below the first frame */
+  entry = newSlot(&r);
+  prev = -1;
+  for (i = 0; i < m->lsp; i++) {
+    s = i ? newSlot(&r) : entry;
+    if (prev >= 0) r.apps[prev].atom[0] = mkPTR(0, s);
+    r.apps[s].tag = CASE;
+    r.apps[s].info = m->lstack[i];
+    r.apps[s].size = 1;
+    prev = s;
+  }
+  s = m->lsp ? newSlot(&r) : entry;
+  if (prev >= 0) r.apps[prev].atom[0] = mkPTR(0, s);
+
+  /* The apps of the frames, taking the place of the originals */
+  for (k = 0; k < m->usp; k++) {
+    Int h = m->ustack[k].haddr;
+    if (r.slot[h] >= 0)
+      fail(RED_EINVALID, "app %d is under evaluation twice", h);
+    r.slot[h] = newSlot(&r);
+  }
+  chainSegment(&r, s, 0, m->usp ? m->ustack[0].saddr-1 : m->sp, 0);
+  for (k = 0; k < m->usp; k++)
+    chainSegment(&r, r.slot[m->ustack[k].haddr], m->ustack[k].saddr-1,
+                 k+1 < m->usp ? m->ustack[k+1].saddr-1 : m->sp, k+1);
+
+  /* Then everything they reach */
+  while (r.numTodo > 0) {
+    Int addr = r.todo[--r.numTodo];
+    CacheLine c;
+
+    unpackApp(&c, &m->heap[addr]);
+    if (c.extra) {
+      /* A long app goes back to being a chain */
+      Atom xs[MAXAPPLEN];
+      Int n = c.size + c.extra;
+      for (i = 0; i < c.extra; i++)
+        xs[c.extra-1 - i] = longAtom(&m->heap[addr], i);
+      for (i = 0; i < c.size; i++)
+        xs[n-1 - i] = c.atom[i];
+      chainApps(&r, r.slot[addr], xs, n);
+      r.apps[r.slot[addr]].nf = c.nf;
+      continue;
+    }
+    for (i = 0; i < c.size; i++)
+      c.atom[i] = residualAtom(&r, c.atom[i]);
+    r.apps[r.slot[addr]] = c;
+  }
+
+  if (!(f = fopen(file, "w")))
+    fail(RED_EIO, "couldn't write residual program %s", file);
+  writeBuilder(f, m, &r, 0, entry);
+  for (i = 1; i < m->numTemplates; i++)
+    writeRedTemplate(f, m, &m->code[i]);
+  writeRedTemplate(f, m, &m->code[0]);
+  for (j = 1; j < (r.numApps+1)/2; j++)
+    writeBuilder(f, m, &r, j, entry);
+  if (fclose(f) != 0)
+    fail(RED_EIO, "couldn't write residual program %s", file);
+
+  free(r.slot);
+  free(r.todo);
+  free(r.apps);
 }
 
-void dispatch(void)
+/* Run m to at ticks and write the rest of the run to file, or just run
+   it if it finishes first.  A template split over several applications
+   passes the primitive results of one part to the next in registers,
+   which a program can't express: the machine goes on one application
+   at a time until such a continuation is done (see canCollect()) */
+
+RedStatus runResidual(Machine *m, const char *file, Long at)
 {
-  Atom top;
+  RedStatus status;
 
-  while (!(sp == 1 && isINT(stack[0]))) {
-    if (sp > MAXSTACKELEMS-100) stackOverflow();
-    if (usp > MAXSTACKELEMS-100) stackOverflow();
-    if (lsp > MAXSTACKELEMS-100) stackOverflow();
-    if (hp > MAXHEAPAPPS-200 && canCollect()) collect();
-    top = stack[sp-1];
-    if (isPTR(top)) {
-      unwind(getPTRShared(top), getPTRId(top));
-      unwindCount++;
-    }
-    else if (usp > 0 && updateCheck(top, ustack[usp-1])) {
-      update(top, ustack[usp-1].saddr, ustack[usp-1].haddr);
-      updateCount++;
-    }
-    else {
-        if (isINT(top)) {
-            assert(isPRI(stack[sp-2]));
-            applyPrim();
-        }
-        else if (isCON(top)) {
-            selectCount++;
-            caseSelect(getCONIndex(top));
-        }
-        else if (isFUN(top)) {
-            profTable[getFUNId(top)].callCount++;
-            applyCount++;
-            apply(&code[getFUNId(top)]);
-        }
-        else
-            error("dispatch(): invalid tag.");
+  m->tickLimit = at;
+  while ((status = run(m)) == RED_BUDGET && !canCollect(m))
+    m->tickLimit = ticks(m) + 1;
+  if (status != RED_BUDGET)
+    return status;
+  writeResidual(m, file);
+  fprintf(stderr, "%s: the rest of the run from %lld ticks written to %s\n",
+          program_name, ticks(m), file);
+  return RED_HALTED;
+}
+
+/* Library interface (see reduceron.h)
+
+   Each call catches the errors of the code it runs with a handler of
+   its own, and frees whatever it had allocated before returning the
+   status. */
+
+static pthread_once_t atomsOnce = PTHREAD_ONCE_INIT;
+
+void redDefaultOptions(RedOptions *opts)
+{
+  memset(opts, 0, sizeof *opts);
+  opts->heapApps    = DEFHEAPAPPS;
+  opts->heapLimit   = MAXHEAPLIMIT;
+  opts->stackElems  = DEFSTACKELEMS;
+  opts->ustackElems = DEFUSTACKELEMS;
+  opts->lstackElems = DEFLSTACKELEMS;
+  opts->cacheLines  = DEFCACHELINES;
+  opts->out         = stdout;
+}
+
+RedStatus redLoadProgram(const char *file, RedProgram **progp)
+{
+  jmp_buf handler;
+  Program *volatile prog = NULL;
+
+  *progp = NULL;
+  errorHandler = &handler;
+  if (setjmp(handler)) {
+    errorHandler = NULL;
+    if (prog) {
+      freeProgram(prog);
+      free(prog);
     }
+    return errorStatus;
   }
+  if (!file)
+    error("no program file");
+  if (!(prog = malloc(sizeof *prog)))
+    fail(RED_ENOMEM, "out of memory loading %s", file);
+  loadProgram(prog, file);
+  errorHandler = NULL;
+  *progp = prog;
+  return RED_OK;
 }
 
-/* Parser for .red files */
+void redFreeProgram(RedProgram *prog)
+{
+  if (prog) {
+    freeProgram(prog);
+    free(prog);
+  }
+}
 
-Int strToBool(Char *s)
+RedStatus redCreateContext(const RedProgram *prog, const RedOptions *opts,
+                           RedMachine **mp)
 {
-  if (!strcmp(s, "True")) return 1;
-  if (!strcmp(s, "False")) return 0;
-  error("Parse error: boolean expected; got %s", s);
-  return 0;
+  jmp_buf handler;
+  Machine config;
+  Machine *volatile m = NULL;
+
+  *mp = NULL;
+  errorHandler = &handler;
+  if (setjmp(handler)) {
+    errorHandler = NULL;
+    if (m) freeMachine(m);
+    return errorStatus;
+  }
+  if (!prog || !opts)
+    error("no program or options");
+  pthread_once(&atomsOnce, initAtoms);
+
+  defaultConfig(&config);
+  config.maxHeapApps    = opts->heapApps;
+  config.heapLimit      = opts->heapLimit;
+  config.nurseryApps    = opts->nurseryApps;
+  config.maxStackElems  = opts->stackElems;
+  config.maxUStackElems = opts->ustackElems;
+  config.maxLStackElems = opts->lstackElems;
+  config.cacheLines     = opts->cacheLines;
+  config.tracingEnabled = opts->tracing != 0;
+  config.squeeze        = opts->squeezeUpdates != 0;
+  config.asyncSerial    = opts->asyncSerial != 0;
+  config.engine         = opts->threaded || opts->jit ? dispatchThreaded
+                                                    : dispatch;
+  config.jit            = opts->jit != 0;
+  config.in             = opts->in;
+  config.out            = opts->out;
+  if (config.heapLimit > MAXHEAPLIMIT)
+    error("heap limit %d above the maximum %d", config.heapLimit,
+          MAXHEAPLIMIT);
+  if (config.cacheLines < 0 || config.cacheLines > 1 << 20)
+    error("heap cache of %d lines out of range", config.cacheLines);
+  if (config.nurseryApps && config.nurseryApps < 2*HEAPMARGIN)
+    error("nursery of %d apps too small", config.nurseryApps);
+  checkConfig(&config);
+
+  newMachine(&config, (Machine **) &m);
+  resetMachine(m, prog);
+  errorHandler = NULL;
+  *mp = m;
+  return RED_OK;
 }
 
-void strToPrim(Char *s, Prim *p, Bool *b)
+RedStatus redRun(RedMachine *m, long long budget)
 {
-  *b = 0;
-  if (!strcmp(s, "emit")) { *p = EMIT; return; }
-  if (!strcmp(s, "emitInt")) { *p = EMITINT; return; }
-  if (!strcmp(s, "(!)")) { *p = SEQ; return; }
-  if (!strncmp(s, "swap:", 5)) {
-    *b = 1;
-    s = s+5;
+  jmp_buf handler;
+  RedStatus status;
+
+  if (m->status != RED_BUDGET) {
+    snprintf(errorMessage, sizeof errorMessage,
+             "machine must be reset before running again");
+    return RED_EINVALID;
   }
-  if (!strcmp(s, "(+)")) { *p = ADD; return; }
-  if (!strcmp(s, "(-)")) { *p = SUB; return; }
-  if (!strcmp(s, "(==)")) { *p = EQ; return; }
-  if (!strcmp(s, "(/=)")) { *p = NEQ; return; }
-  if (!strcmp(s, "(<=)")) { *p = LEQ; return; }
-  if (!strcmp(s, "(.&.)")) { *p = AND; return; }
-  if (!strcmp(s, "st32")) { *p = ST32; return; }
-  if (!strcmp(s, "ld32")) { *p = LD32; return; }
-  error("Parse error: unknown primitive %s", s);
+  errorHandler = &handler;
+  if (setjmp(handler)) {
+    errorHandler = NULL;
+    return m->status = errorStatus;
+  }
+  m->tickLimit = budget > 0 && ticks(m) <= LLONG_MAX - budget
+               ? ticks(m) + budget : LLONG_MAX;
+  status = run(m);
+  errorHandler = NULL;
+  return status;
 }
 
-Bool parseAtom(FILE *f, Atom* result)
+RedStatus redReset(RedMachine *m)
 {
-  Char str[16];
-  Int v;
-  Int a, i;
-  Bool swap;
-  Prim p;
+  jmp_buf handler;
 
-  return (
-    (  fscanf(f, " INT%*[ (]%i)", &v) == 1
-    && perform(*result = mkINT(v))
-    )
-    ||
-    (  fscanf(f, " ARG %5s%*[ (]%i)", str, &i) == 2
-    && perform(*result = mkARG(strToBool(str), i))
-    )
-    ||
-    (  fscanf(f, " VAR %5s%*[ (]%i)", str, &i) == 2
-    && perform(*result = mkPTR(strToBool(str), i))
-    )
-    ||
-    (  fscanf(f, " REG %5s%*[ (]%i)", str, &i) == 2
-    && perform(*result = mkREG(strToBool(str), i))
-    )
-    ||
-    (  fscanf(f, " CON%*[ (]%i%*[ )(]%i)",
-         &a, &i) == 2
-    && perform(*result = mkCON(a,i))
-    )
-    ||
-    (  fscanf(f, " FUN %5s%*[ (]%i%*[ )(]%i)",
-         str, &a, &i) == 3
-    && perform(*result = mkFUN(strToBool(str), a, i))
-    )
-    ||
-    (  fscanf(f, " PRI%*[ (]%i%*[) ]\"%10[^\"]\"", &a, str)
-    && perform(strToPrim(str, &p, &swap))
-    && perform(*result = mkPRI(a, swap, p))
-    )
-  );
+  errorHandler = &handler;
+  if (setjmp(handler)) {
+    errorHandler = NULL;
+    return m->status = errorStatus;
+  }
+  resetMachine(m, m->prog);
+  errorHandler = NULL;
+  return RED_OK;
 }
 
-#define makeListParser(fun, p, elem)                                        \
-  Int fun(FILE *f, Int n, elem *xs)                                         \
-    {                                                                       \
-      Char c;                                                               \
-      Int i = 0;                                                            \
-      if (! (fscanf(f, " %c", &c) == 1 && c == '['))                        \
-        error("Parse error: expecting '['");                                \
-      for (;;) {                                                            \
-        if (i >= n)                                                         \
-          error("Parse error: list contains too many elements");            \
-        if (p(f, &xs[i])) i++;                                              \
-        if (fscanf(f, " %c", &c) == 1 && (c == ',' || c == ']')) {          \
-          if (c == ']') return i;                                           \
-        }                                                                   \
-        else error("Parse error");                                          \
-      }                                                                     \
-      return 0;                                                             \
-    }
+void redDestroy(RedMachine *m)
+{
+  if (m) freeMachine(m);
+}
 
-makeListParser(parseAtoms, parseAtom, Atom)
+int redResult(const RedMachine *m)
+{
+  return m->status == RED_OK ? getINTValue(m->stack[0]) : 0;
+}
 
-Bool parseApp(FILE *f, App *app)
+long long redTicks(const RedMachine *m)
 {
-  Char str[16];
-  Bool success;
-  Atom atoms[APSIZE];
-  AppTag tag;
-  Bool nf = false;
-  Int info = 0, size;
+  return ticks(m);
+}
 
-  success =
-    (  fscanf(f, " APP %5s ", str) == 1
-    && perform(tag = AP)
-    && perform(nf = strToBool(str))
-    )
-    ||
-    (  fscanf(f, " CASE %i ", &info) == 1
-    && perform(tag = CASE)
-    )
-    ||
-    (  fscanf(f, " PRIM %i ", &info) == 1
-    && perform(tag = PRIM)
-    );
-  if (!success) return 0;
-  size = parseAtoms(f, APSIZE, atoms);
+const char *redErrorMessage(void)
+{
+  return errorMessage;
+}
 
-  if (tag == CASE || tag == PRIM)
-      assert(size < 4);
+/* Batch mode
 
-  *app = mkApp(tag, size, nf, info, atoms);
+   Jobs (a program and optionally a file for its serial input) are run
+   by a pool of worker threads, each with a machine of its own, while
+   the main thread prints the output of each job in job order as soon
+   as it and all the jobs before it are done.  Programs named by more
+   than one job are loaded once and shared. */
 
-  return 1;
-}
+typedef struct
+  {
+    const char *file, *input;
+    Program *prog;
+    char *out;                          // everything the job printed
+    size_t outSize;
+    Long ticks;
+    Bool done;
+  } Job;
 
-makeListParser(parseApps, parseApp, App)
+typedef struct
+  {
+    Job *jobs;
+    Int numJobs, next;
+    const Machine *config;
+    Bool verbose;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+  } Batch;
 
-Bool parseLut(FILE *f, Int *i)
+/* A job that fails is reported in its output and doesn't stop the
+   others */
+
+void runJob(Batch *b, Machine *m, Job *job)
 {
-    return fscanf(f, " %i", i) == 1;
-}
+  FILE *out = open_memstream(&job->out, &job->outSize);
+  jmp_buf handler;
 
-makeListParser(parseLuts, parseLut, Lut)
+  if (!out) fail(RED_ENOMEM, "out of memory for the output of %s", job->file);
+  m->in = NULL;
+  m->out = out;
 
-Bool parseString(FILE *f, Int n, Char *str)
+  errorHandler = &handler;
+  if (setjmp(handler))
+    fprintf(out, "%s: error: %s\n", program_name, errorMessage);
+  else {
+    if (job->input && !(m->in = fopen(job->input, "r")))
+      fail(RED_EIO, "%s: %s", job->input, strerror(errno));
+    resetMachine(m, job->prog);
+    if (run(m) != RED_HALTED)
+      report(m, b->verbose);
+  }
+  errorHandler = NULL;
+  job->ticks = ticks(m);
+
+  if (m->in) fclose(m->in);
+  fclose(out);
+}
+
+void *worker(void *arg)
 {
-  Int i;
-  Char c;
-  if (fscanf(f, " \"") != 0)
-      return 0;
+  Batch *b = arg;
+  Machine *m;
+  Int j;
 
-  for (i = 0; ; i++) {
-    if (i >= n || fscanf(f, "%c", &c) != 1) return 0;
-    if (c == '"') {
-      str[i] = '\0';
-      return 1;
-    }
-    str[i] = c;
+  newMachine(b->config, &m);
+
+  for (;;) {
+    pthread_mutex_lock(&b->lock);
+    j = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (j >= b->numJobs) break;
+
+    runJob(b, m, &b->jobs[j]);
+
+    pthread_mutex_lock(&b->lock);
+    b->jobs[j].done = 1;
+    pthread_cond_broadcast(&b->finished);
+    pthread_mutex_unlock(&b->lock);
   }
+  freeMachine(m);
+  return NULL;
 }
 
-Bool parseTemplate(FILE *f, Template *t)
+/* Read jobs, one per line of the form "program [input]", from a file */
+
+Int readJobList(const char *file, Job **jobs)
 {
-  Char c;
-  if (fscanf(f, " (") != 0)
-      return 0;
-  if (parseString(f, NAMELEN, t->name) == 0) return 0;
-  if (fscanf(f, " ,%i,", &t->arity) != 1) return 0;
-  t->numLuts = parseLuts(f, MAXLUTS, t->luts);
-  if (!(fscanf(f, " %c", &c) == 1 && c == ',')) error("Parse error");
-  t->numPushs = parseAtoms(f, MAXPUSH, t->pushs);
-  if (!(fscanf(f, " %c", &c) == 1 && c == ',')) error("Parse error");
-  t->numApps = parseApps(f, MAXAPS, t->apps);
-  if (!(fscanf(f, " %c", &c) == 1 && c == ')')) error("Parse error");
-  return 1;
+  FILE *f = fopen(file, "r");
+  char line[1024], prog[512], input[512];
+  Int n = 0, max = 0, fields;
+
+  if (!f) {
+    perror(file);
+    exit(-1);
+  }
+  *jobs = NULL;
+  while (fgets(line, sizeof line, f)) {
+    if ((fields = sscanf(line, " %511s %511s", prog, input)) < 1 ||
+        prog[0] == '#')
+      continue;
+    if (n == max) {
+      max = 2*max + 16;
+      *jobs = realloc(*jobs, sizeof(Job) * max);
+      if (!*jobs) fail(RED_ENOMEM, "out of memory reading %s", file);
+    }
+    memset(&(*jobs)[n], 0, sizeof(Job));
+    (*jobs)[n].file = strdup(prog);
+    (*jobs)[n].input = fields == 2 ? strdup(input) : NULL;
+    n++;
+  }
+  fclose(f);
+  return n;
 }
 
-Int parse(FILE *f, Int n, Template *ts)
+void runBatch(Job *jobs, Int numJobs, Int numWorkers,
+              const Machine *config, Bool verbose)
 {
-  Int i = 0;
+  Batch b;
+  pthread_t *threads = malloc(sizeof(pthread_t) * numWorkers);
+  Int i, j, numPrograms = 0;
+  Long totalTicks = 0;
+  double start = now(), wall;
 
-  for (;;) {
-      if (i >= n) error("Parse error: too many templates");
-    if (!parseTemplate(f, &ts[i])) return i;
-    i++;
+  if (!threads) fail(RED_ENOMEM, "out of memory starting workers");
+
+  /* Load every program before starting, once each */
+  for (i = 0; i < numJobs; i++) {
+    for (j = 0; j < i; j++)
+      if (strcmp(jobs[j].file, jobs[i].file) == 0) break;
+    if (j < i)
+      jobs[i].prog = jobs[j].prog;
+    else {
+      jobs[i].prog = malloc(sizeof(Program));
+      if (!jobs[i].prog) fail(RED_ENOMEM, "out of memory loading %s", jobs[i].file);
+      loadProgram(jobs[i].prog, jobs[i].file);
+      numPrograms++;
+    }
+  }
+
+  b.jobs = jobs;
+  b.numJobs = numJobs;
+  b.next = 0;
+  b.config = config;
+  b.verbose = verbose;
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.finished, NULL);
+
+  for (i = 0; i < numWorkers; i++)
+    if (pthread_create(&threads[i], NULL, worker, &b) != 0)
+      error("couldn't start worker thread");
+
+  for (i = 0; i < numJobs; i++) {
+    pthread_mutex_lock(&b.lock);
+    while (!jobs[i].done)
+      pthread_cond_wait(&b.finished, &b.lock);
+    pthread_mutex_unlock(&b.lock);
+
+    printf("==> %s%s%s <==\n", jobs[i].file,
+           jobs[i].input ? " < " : "", jobs[i].input ? jobs[i].input : "");
+    fwrite(jobs[i].out, 1, jobs[i].outSize, stdout);
+    fflush(stdout);
+    free(jobs[i].out);
+    totalTicks += jobs[i].ticks;
   }
+
+  for (i = 0; i < numWorkers; i++)
+    pthread_join(threads[i], NULL);
+  wall = now() - start;
+  free(threads);
+
+  fprintf(stderr, "\n==== BATCH SUMMARY ====\n");
+  fprintf(stderr, "Jobs        = %12d\n", numJobs);
+  fprintf(stderr, "Programs    = %12d\n", numPrograms);
+  fprintf(stderr, "Workers     = %12d\n", numWorkers);
+  fprintf(stderr, "Wall time   = %12.3f s\n", wall);
+  fprintf(stderr, "Jobs/s      = %12.1f\n", numJobs / wall);
+  fprintf(stderr, "Ticks       = %12lld\n", totalTicks);
+  fprintf(stderr, "Ticks/s     = %12.0f\n", totalTicks / wall);
+  fprintf(stderr, "=======================\n");
 }
 
 /* Main function */
 
+#ifndef REDUCERON_LIBRARY
+#ifdef REDUCERON_RUNTIME
+/* From the C red2c wrote (see writeC()) */
+extern const JitCode redCode[];
+extern const Int redNumCode;
+extern const char redSource[];
+#endif
+
 int main(int argc, char **argv)
 {
-  FILE *f;
-  Long ticks;
+  Machine config;
+  Machine *m;
+  Program prog;
   int ch;
   Bool verbose = 0;
+  const char *imageFile = NULL, *jobList = NULL;
+  Int numWorkers = 0;
+  Bool profiling = 0;
+  const char *snapshotFile = NULL, *restoreFile = NULL, *residualFile = NULL;
+  const char *cFile = NULL;
+  Long snapshotAt = LLONG_MAX;
+  RedStatus status;
+  char *end;
+
+  defaultConfig(&config);
+#ifdef REDUCERON_RUNTIME
+  config.engine = dispatchThreaded;
+#endif
+
+  sizeFromEnv("REDUCERON_HEAP", "heap", 2*HEAPMARGIN, MAXHEAPLIMIT,
+              &config.maxHeapApps);
+  sizeFromEnv("REDUCERON_NURSERY", "nursery", 2*HEAPMARGIN, MAXHEAPLIMIT/4,
+              &config.nurseryApps);
+  sizeFromEnv("REDUCERON_CACHE", "heap cache", 0, 1 << 20,
+              &config.cacheLines);
+  sizeFromEnv("REDUCERON_STACK", "stack", 2*STACKMARGIN, 1 << 30,
+              &config.maxStackElems);
+  sizeFromEnv("REDUCERON_USTACK", "update stack", 2*STACKMARGIN, 1 << 30,
+              &config.maxUStackElems);
+  sizeFromEnv("REDUCERON_LSTACK", "case stack", 2*STACKMARGIN, 1 << 30,
+              &config.maxLStackElems);
 
-  while ((ch = getopt(argc, argv, "vt")) != -1) {
+  while ((ch = getopt(argc, argv, "vtqapP:g:k:K:r:x:c:i:m:d:o:j:B:C:H:M:N:S:U:L:")) != -1) {
       switch (ch) {
       case 'v':
           verbose = 1;
           break;
       case 't':
-          tracingEnabled = 1;
+          config.tracingEnabled = 1;
+          break;
+      case 'q':
+          config.squeeze = 1;
+          break;
+      case 'a':
+          config.asyncSerial = 1;
+          break;
+      case 'P':
+          config.foldedFile = optarg;
+          /* fall through */
+      case 'p':
+          profiling = 1;
+          break;
+      case 'g':
+          config.censusFile = optarg;
+          break;
+      case 'k':
+          snapshotFile = optarg;
+          break;
+      case 'K':
+          snapshotAt = strtoll(optarg, &end, 0);
+          if (*end != '\0' || snapshotAt <= 0)
+              error("invalid tick count %s", optarg);
+          break;
+      case 'r':
+          restoreFile = optarg;
+          break;
+      case 'x':
+          residualFile = optarg;
+          break;
+      case 'c':
+          cFile = optarg;
+          break;
+      case 'm':
+          if (config.numDeviceSpecs == MAXDEVICES)
+              error("no more than %d devices", MAXDEVICES);
+          config.deviceSpecs[config.numDeviceSpecs++] = optarg;
+          break;
+      case 'i':
+          config.flushInterval = parseSize(optarg, "flush interval", 0,
+                                           1 << 30) * 1e-3;
+          break;
+      case 'd':
+          if (strcmp(optarg, "switch") == 0)
+              config.engine = dispatch;
+          else if (strcmp(optarg, "threaded") == 0)
+              config.engine = dispatchThreaded;
+          else if (strcmp(optarg, "jit") == 0) {
+#ifdef JIT
+              config.engine = dispatchThreaded;
+              config.jit = 1;
+#else
+              error("the JIT needs an x86-64 machine");
+#endif
+          }
+          else
+              error("unknown dispatch engine %s (switch, threaded or jit)",
+                    optarg);
+          break;
+      case 'o':
+          imageFile = optarg;
+          break;
+      case 'j':
+          numWorkers = parseSize(optarg, "worker pool", 1, 1024);
+          break;
+      case 'B':
+          jobList = optarg;
+          break;
+      case 'C':
+          config.cacheLines = parseSize(optarg, "heap cache", 0, 1 << 20);
+          break;
+      case 'H':
+          config.maxHeapApps = parseSize(optarg, "heap", 2*HEAPMARGIN,
+                                         MAXHEAPLIMIT);
+          break;
+      case 'M':
+          config.heapLimit = parseSize(optarg, "heap limit", 2*HEAPMARGIN,
+                                       MAXHEAPLIMIT);
+          break;
+      case 'N':
+          config.nurseryApps = parseSize(optarg, "nursery", 2*HEAPMARGIN,
+                                         MAXHEAPLIMIT/4);
+          break;
+      case 'S':
+          config.maxStackElems = parseSize(optarg, "stack", 2*STACKMARGIN,
+                                           1 << 30);
+          break;
+      case 'U':
+          config.maxUStackElems = parseSize(optarg, "update stack",
+                                            2*STACKMARGIN, 1 << 30);
+          break;
+      case 'L':
+          config.maxLStackElems = parseSize(optarg, "case stack",
+                                            2*STACKMARGIN, 1 << 30);
           break;
       default:
-          error("only options v, t and p supported");
+          error("only options v, t, q, a, p, P, g, k, K, r, x, c, i, m, d, o, j, B, C, H, M, N, S, "
+                "U and L supported");
           break;
       }
   }
@@ -792,45 +5732,107 @@ int main(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
-  if (argc != 1)
-      error("Need .red file or - for stdin");
+  /* Profiling has an engine of its own */
+  if (profiling)
+      config.engine = dispatchProfiled;
+  checkConfig(&config);
+  initAtoms();
 
-  if (strcmp(argv[0], "-") == 0)
-      f = stdin;
-  else
-      f = fopen(argv[0], "r");
+#ifdef REDUCERON_RUNTIME
+  if (numWorkers || jobList || restoreFile || imageFile || cFile)
+      error("-j, -B, -r, -o and -c can't be used with a built-in program");
+#endif
 
-  if (!f) {
-      perror(argv[0]);
-      exit(-1);
-  }
-
-  alloc();
-  numTemplates = parse(f, MAXTEMPLATES, code);
-  if (numTemplates <= 0) error("No templates were parsed!");
-  init();
-  dispatch();
-
-  if (verbose) {
-      printf("\n==== EXECUTION REPORT ====\n");
-      printf("Result      = %12i\n", getINTValue(stack[0]));
-      ticks = swapCount + primCount + applyCount +
-          unwindCount + updateCount;
-      printf("Ticks       = %12lld\n", ticks);
-      printf("Swap        = %11.1f%%\n", (100.0*swapCount)/ticks);
-      printf("Prim        = %11.1f%%\n", (100.0*primCount)/ticks);
-      printf("Unwind      = %11.1f%%\n", (100.0*unwindCount)/ticks);
-      printf("Update      = %11.1f%%\n", (100.0*updateCount)/ticks);
-      printf("Apply       = %11.1f%%\n", (100.0*applyCount)/ticks);
-      printf("PRS Success = %11.1f%%\n",
-             (100.0*prsSuccessCount)/(1+prsCandidateCount));
-      printf("#GCs        = %12d\n", gcCount);
-      printf("==========================\n");
+  if (numWorkers || jobList) {
+      Job *jobs;
+      Int numJobs, i;
+
+      if (imageFile)
+          error("-o can't be used in batch mode");
+      if (config.foldedFile)
+          error("-P can't be used in batch mode");
+      if (config.censusFile)
+          error("-g can't be used in batch mode");
+      if (snapshotFile || restoreFile)
+          error("snapshots can't be used in batch mode");
+      if (residualFile)
+          error("-x can't be used in batch mode");
+      if (config.asyncSerial)
+          error("-a can't be used in batch mode");
+      if (jobList)
+          numJobs = readJobList(jobList, &jobs);
+      else {
+          numJobs = argc;
+          jobs = calloc(numJobs, sizeof(Job));
+          if (!jobs) fail(RED_ENOMEM, "out of memory");
+          for (i = 0; i < numJobs; i++)
+              jobs[i].file = argv[i];
+      }
+      if (jobList ? argc != 0 : argc == 0)
+          error("Need .red files, or a job list with -B");
+      if (!numWorkers)
+          numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+      if (numWorkers > numJobs)
+          numWorkers = numJobs;
+      if (numJobs > 0)
+          runBatch(jobs, numJobs, numWorkers, &config, verbose);
+      return 0;
+  }
+
+  if (snapshotAt != LLONG_MAX && !snapshotFile && !residualFile)
+      error("-K needs a snapshot file (-k) or a residual program (-x)");
+  if (residualFile && (snapshotAt == LLONG_MAX || snapshotFile))
+      error("-x needs -K and no -k");
+  if (residualFile && config.asyncSerial)
+      error("-x can't be used with -a");
+
+  if (restoreFile) {
+      if (argc != 0)
+          error("-r takes the place of the .red file");
+      loadSnapshot(&prog, &config, restoreFile);
+      checkConfig(&config);
+  } else {
+#ifdef REDUCERON_RUNTIME
+      if (argc != 0)
+          error("the program is built in, so no .red file");
+      loadSource(&prog, redSource);
+      if (prog.numTemplates != redNumCode)
+          error("built-in program of %d templates, but code for %d",
+                prog.numTemplates, redNumCode);
+      config.nativeCode = redCode;
+#else
+      if (argc != 1)
+          error("Need .red file or - for stdin");
+      loadProgram(&prog, argv[0]);
+#endif
   }
-  else
-      printf("%d\n", getINTValue(stack[0]));
 
-  //  displayProfTable();
+  if (imageFile) {
+      writeImage(&prog, imageFile);
+      return 0;
+  }
+  if (cFile) {
+      if (restoreFile || prog.image || strcmp(argv[0], "-") == 0)
+          error("-c needs a .red file");
+      writeC(&prog, argv[0], cFile);
+      return 0;
+  }
+
+  newMachine(&config, &m);
+  m->in = stdin;
+  resetMachine(m, &prog);
+  if (restoreFile)
+      restoreMachine(m);
+
+  status = snapshotFile ? runSnapshotting(m, snapshotFile, snapshotAt)
+         : residualFile ? runResidual(m, residualFile, snapshotAt)
+         : run(m);
+
+  /* Running out of input ends the program without a result */
+  if (status == RED_HALTED)
+      return 0;
+  report(m, verbose);
 
   return 0;
 }
+#endif
@@ -6,6 +6,7 @@
 /* =================================== */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,12 +22,24 @@
 #define MAXLUTS 2
 #define MAXREGS 8
 
-#define MAXHEAPAPPS    8192
-#define MAXSTACKELEMS  1024
-#define MAXUSTACKELEMS 512
-#define MAXLSTACKELEMS 512
 #define MAXTEMPLATES   1024
 
+/* Default sizes of the heap and stacks.  These can be overridden at
+   run time with -H/-S/-U/-L or the REDUCERON_HEAP, REDUCERON_STACK,
+   REDUCERON_USTACK and REDUCERON_LSTACK environment variables.  The
+   heap grows (up to -M apps, if given) when a collection leaves it
+   more than half full. */
+
+#define DEFHEAPAPPS    8192
+#define DEFSTACKELEMS  1024
+#define DEFUSTACKELEMS 512
+#define DEFLSTACKELEMS 512
+
+#define HEAPMARGIN     200
+#define STACKMARGIN    50
+#define USTACKMARGIN   4
+#define LSTACKMARGIN   4
+
 #define NAMELEN 128
 
 //#define ONEBITGC_STUDY1  1
@@ -62,7 +75,8 @@ typedef struct { Int arity; Int index; } Con;
 
 typedef struct { Bool original; Int arity; Int id; } Fun;
 
-typedef enum { ADD, SUB, EQ, NEQ, LEQ, EMIT, EMITINT, SEQ, AND, ST32, LD32, LAST_PRIM } Prim;
+typedef enum { ADD, SUB, EQ, NEQ, LEQ, EMIT, EMITINT, SEQ, AND, ST32, LD32,
+               MUL, QUOT, REM, OR, XOR, SHL, SHR, LAST_PRIM } Prim;
 
 typedef struct { Int arity; Bool swap; Prim id; } Pri;
 
@@ -125,6 +139,12 @@ Int hp, gcLow, gcHigh, sp, usp, lsp, end, gcCount;
 
 Int numTemplates;
 
+Int maxHeapApps    = DEFHEAPAPPS;
+Int maxStackElems  = DEFSTACKELEMS;
+Int maxUStackElems = DEFUSTACKELEMS;
+Int maxLStackElems = DEFLSTACKELEMS;
+Int heapLimit      = 0; // Upper bound for heap growth, 0 = unbounded
+
 /* Profiling info */
 
 Long swapCount, primCount, applyCount, unwindCount,
@@ -133,7 +153,8 @@ Long swapCount, primCount, applyCount, unwindCount,
 Int maxHeapUsage, maxStackUsage, maxUStackUsage, maxLStackUsage;
 
 Bool tracingEnabled = 0;
-int stepno = 0;
+Bool checkUniqueness = 0;
+Long stepno = 0;
 
 #if ONEBITGC_STUDY1
 Long sumCollected, sumOneBitCollected;
@@ -150,6 +171,7 @@ ProfEntry *profTable;
 
 void stackOverflow(const char *);
 void integerAddOverflow(int a, int b);
+void integerMulOverflow(int a, int b);
 
 static const char *__restrict program_name;
 
@@ -218,6 +240,162 @@ static void refcntcheck(Atom a)
     }
 }
 
+/* Event trace
+
+   With -t each reduction step (and each collection and serial I/O
+   access) appends one fixed-size record to a ring buffer holding the
+   last -R records, which is written to the trace file (-T, default
+   emu.trace) when the emulator exits.  -F filters restrict which steps
+   are recorded:
+
+     -F fun=NAME     steps in templates named NAME (repeatable); steps
+                     other than applications count as in the template
+                     applied last
+     -F steps=A-B    steps A to B (either end may be left out)
+     -F heap=N       steps taken with at least N apps on the heap
+
+   "emu -D trace prog.red" decodes a trace, filtered in the same way,
+   back into a readable listing. */
+
+typedef enum { TR_UNWIND, TR_UPDATE, TR_APPLY, TR_PRIM, TR_SWAP, TR_SELECT,
+               TR_GC, TR_LD32, TR_ST32, LAST_TR } TraceRule;
+
+typedef struct {
+    uint64_t step;
+    uint8_t rule;
+    uint8_t alloc;              // apps allocated by the step
+    uint16_t unused;
+    int32_t fun;                // template applied, or applied last
+    int32_t sp, hp, usp, lsp;   // before the step
+    int32_t arg, arg2;          // see showTraceRecord()
+  } TraceRecord;
+
+typedef struct {
+    char magic[8];              // TRACEMAGIC
+    uint32_t version, recordSize;
+    uint64_t recorded, kept;    // records passing the filters, and kept
+  } TraceHeader;
+
+#define TRACEMAGIC "REDTRACE"
+#define DEFTRACERECORDS (1 << 20)
+
+const char *traceFile = "emu.trace";
+Long traceRecords = DEFTRACERECORDS;
+TraceRecord *traceRing;
+Long traceRecorded;
+Int traceFun = 0;               // the template applied last
+
+/* Filters */
+Long traceFrom = 0, traceTo = -1;
+Int traceMinHeap = 0;
+const char *traceNames[MAXTEMPLATES];
+Int numTraceNames;
+Bool *traceFunSelected;         // by template, if there are names
+
+void addTraceFilter(const char *spec)
+{
+  char *end;
+
+  if (strncmp(spec, "fun=", 4) == 0 && spec[4]) {
+    if (numTraceNames == MAXTEMPLATES) error("too many -F fun= filters");
+    traceNames[numTraceNames++] = spec + 4;
+  }
+  else if (strncmp(spec, "steps=", 6) == 0) {
+    const char *range = spec + 6, *hyphen = strchr(range, '-');
+
+    if (!hyphen) error("invalid step range %s (expected A-B)", range);
+    traceFrom = 0;
+    if (hyphen > range && (traceFrom = strtoll(range, &end, 0), end != hyphen))
+      error("invalid step range %s (expected A-B)", range);
+    traceTo = -1;
+    if (hyphen[1] && (traceTo = strtoll(hyphen+1, &end, 0), *end != '\0'))
+      error("invalid step range %s (expected A-B)", range);
+  }
+  else if (strncmp(spec, "heap=", 5) == 0)
+    traceMinHeap = strtol(spec + 5, NULL, 0);
+  else
+    error("unknown trace filter %s (fun=NAME, steps=A-B or heap=N)", spec);
+}
+
+/* Match the name filters against the templates, once parsed */
+
+void selectTraceFuns(void)
+{
+  Int i, j;
+
+  if (!numTraceNames) return;
+  traceFunSelected = calloc(numTemplates, sizeof(Bool));
+  if (!traceFunSelected) error("out of memory for the trace filters");
+  for (j = 0; j < numTraceNames; j++) {
+    Bool found = 0;
+    for (i = 0; i < numTemplates; i++)
+      if (strcmp(code[i].name, traceNames[j]) == 0)
+        traceFunSelected[i] = found = 1;
+    if (!found) error("no template is named %s", traceNames[j]);
+  }
+}
+
+static inline Bool traceSelected(Long step, Int fun, Int heapUsed)
+{
+  return step >= traceFrom && (traceTo < 0 || step <= traceTo) &&
+         heapUsed >= traceMinHeap &&
+         (!traceFunSelected || traceFunSelected[fun]);
+}
+
+void trace(TraceRule rule, Int spBefore, Int hpBefore, Int uspBefore,
+           Int lspBefore, Int arg, Int arg2)
+{
+  TraceRecord *r;
+
+  if (!traceSelected(stepno, traceFun, hpBefore)) return;
+
+  r = &traceRing[traceRecorded++ % traceRecords];
+  r->step = stepno;
+  r->rule = rule;
+  r->alloc = rule == TR_GC || hp < hpBefore ? 0 : hp - hpBefore;
+  r->unused = 0;
+  r->fun = traceFun;
+  r->sp = spBefore;
+  r->hp = hpBefore;
+  r->usp = uspBefore;
+  r->lsp = lspBefore;
+  r->arg = arg;
+  r->arg2 = arg2;
+}
+
+/* Write out the ring, oldest record first (called at exit) */
+
+void writeTrace(void)
+{
+  TraceHeader h;
+  Long kept = traceRecorded < traceRecords ? traceRecorded : traceRecords;
+  Long first = traceRecorded - kept, i;
+  FILE *f = fopen(traceFile, "wb");
+
+  if (!f) {
+    perror(traceFile);
+    return;
+  }
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, TRACEMAGIC, sizeof h.magic);
+  h.version = 1;
+  h.recordSize = sizeof(TraceRecord);
+  h.recorded = traceRecorded;
+  h.kept = kept;
+  fwrite(&h, sizeof h, 1, f);
+  for (i = first; i < traceRecorded; i++)
+    fwrite(&traceRing[i % traceRecords], sizeof(TraceRecord), 1, f);
+  if (fclose(f) != 0)
+    perror(traceFile);
+}
+
+void startTrace(void)
+{
+  traceRing = malloc(sizeof(TraceRecord) * traceRecords);
+  if (!traceRing) error("out of memory for %lld trace records", traceRecords);
+  atexit(writeTrace);
+}
+
 /* Dashing */
 
 Atom dash(Bool sh, Atom a)
@@ -334,14 +512,14 @@ Atom prim_ld32(Num addr)
     */
     Atom res = { .tag = NUM, .contents.num = 666 };
 
-    if (addr == 0)
+    if (addr == 0) {
+        fflush(stdout);                 // the prompt before the answer
         res.contents.num = getchar();
-
-    if (tracingEnabled) {
-        printf("[[ld32 (%d) -> %d]]", addr, res.contents.num);
-        fflush(stdout);
     }
 
+    if (tracingEnabled)
+        trace(TR_LD32, sp, hp, usp, lsp, addr, res.contents.num);
+
     /* This is a hack to terminate otherwise infinite processes */
     if (res.contents.num < 0)
         exit(0);
@@ -358,15 +536,35 @@ Atom prim_st32(Num addr, Num value, Atom k)
     if (addr == 0)
         putchar(value);
 
-    if (tracingEnabled) {
-        printf("[[st32 (%d)=%d]]", addr, value);
-        fflush(stdout);
-    }
+    if (tracingEnabled)
+        trace(TR_ST32, sp, hp, usp, lsp, addr, value);
 
     return k;
 }
 
 
+/* Output is left to stdio's buffering (by line on a terminal), flushed
+   before serial input is read and on exit */
+
+void emitInt(Num n)
+{
+  char digits[12], *p = digits + sizeof digits;
+  unsigned u = n < 0 ? -(unsigned) n : (unsigned) n;
+
+  do *--p = '0' + u % 10; while (u /= 10);
+  if (n < 0) *--p = '-';
+  fwrite(p, 1, digits + sizeof digits - p, stdout);
+}
+
+/* Primitives that fail on some operands aren't speculated: the
+   application may never be demanded */
+
+Bool primFails(Prim p, Atom b)
+{
+  return ((p == QUOT || p == REM) && b.contents.num == 0)
+      || ((p == SHL || p == SHR) && b.contents.num < 0);
+}
+
 Atom prim(Prim p, Atom a, Atom b, Atom c)
 {
   Atom result = { 0 };
@@ -389,11 +587,36 @@ Atom prim(Prim p, Atom a, Atom b, Atom c)
     case EQ: result = n == m ? trueAtom : falseAtom; break;
     case NEQ: result = n != m ? trueAtom : falseAtom; break;
     case LEQ: result = n <= m ? trueAtom : falseAtom; break;
-    case EMIT: printf("%c", n); fflush(stdout); result = b; break;
-    case EMITINT: printf("%i", n); fflush(stdout); result = b; break;
+    case EMIT: putchar(n); result = b; break;
+    case EMITINT: emitInt(n); result = b; break;
     case AND: result.tag = NUM; result.contents.num = TRUNCATE(n&m); break;
     case ST32: result = prim_st32(n, m, c); break;
     case LD32: result = prim_ld32(n); break;
+    case MUL:
+        result.tag = NUM;
+        result.contents.num = TRUNCATE((long long) n*m);
+        if (result.contents.num != (long long) n*m)
+            integerMulOverflow(n, m);
+        break;
+    case QUOT:
+    case REM:
+        if (m == 0)
+            error("division by zero in %d %s %d", n, p == QUOT ? "/" : "%", m);
+        result.tag = NUM;
+        result.contents.num = TRUNCATE(p == QUOT ? n/m : n%m);
+        break;
+    case OR: result.tag = NUM; result.contents.num = TRUNCATE(n|m); break;
+    case XOR: result.tag = NUM; result.contents.num = TRUNCATE(n^m); break;
+    case SHL:
+    case SHR:
+        if (m < 0)
+            error("negative shift in %d %s %d", n, p == SHL ? ".<<." : ".>>.", m);
+        result.tag = NUM;
+        if (p == SHL)
+            result.contents.num = TRUNCATE(m < 32 ? (unsigned) n << m : 0);
+        else
+            result.contents.num = n >> (m < 32 ? m : 31);
+        break;
     case SEQ: assert(0);
     case LAST_PRIM: assert(0);
   }
@@ -481,7 +704,8 @@ void instApp(Int base, Int argPtr, App *app)
     a = getPrimArg(argPtr, a);
     b = getPrimArg(argPtr, b);
     rid = app->details.regId;
-    if (a.tag == NUM && b.tag == NUM) {
+    if (a.tag == NUM && b.tag == NUM
+        && !primFails(app->atoms[1].contents.pri.id, b)) {
       prsSuccessCount++;
       registers[rid] = prim(app->atoms[1].contents.pri.id, a, b, b);
     }
@@ -611,6 +835,25 @@ void updateUStack()
   usp = j;
 }
 
+/* Grow the heap (and to-space) if the last collection left it too
+   full; live data doesn't move, so only the arrays are resized */
+
+void growHeap()
+{
+  Int newSize = maxHeapApps;
+
+  while (hp > newSize/2 && (heapLimit == 0 || newSize < heapLimit))
+    newSize *= 2;
+  if (heapLimit && newSize > heapLimit) newSize = heapLimit;
+  if (newSize == maxHeapApps) return;
+
+  heap = (App*) realloc(heap, sizeof(App) * newSize);
+  free(heap2);
+  heap2 = (App*) malloc(sizeof(App) * newSize);
+  if (!heap || !heap2) error("failed to grow heap to %d apps", newSize);
+  maxHeapApps = newSize;
+}
+
 void collect()
 {
   Int i;
@@ -642,18 +885,19 @@ void collect()
   hp = gcHigh;
 
   if (hp > maxHeapUsage) maxHeapUsage = hp;
-  if (hp > MAXHEAPAPPS-200) stackOverflow("heap");
+  if (hp > maxHeapApps/2) growHeap();
+  if (hp > maxHeapApps-HEAPMARGIN) stackOverflow("heap");
 }
 
 /* Allocate memory */
 
 void alloc()
 {
-  heap = (App*) malloc(sizeof(App) * MAXHEAPAPPS);
-  heap2 = (App*) malloc(sizeof(App) * MAXHEAPAPPS);
-  stack = (Atom*) malloc(sizeof(Atom) * MAXSTACKELEMS);
-  ustack = (Update*) malloc(sizeof(Update) * MAXUSTACKELEMS);
-  lstack = (Lut*) malloc(sizeof(Lut) * MAXLSTACKELEMS);
+  heap = (App*) malloc(sizeof(App) * maxHeapApps);
+  heap2 = (App*) malloc(sizeof(App) * maxHeapApps);
+  stack = (Atom*) malloc(sizeof(Atom) * maxStackElems);
+  ustack = (Update*) malloc(sizeof(Update) * maxUStackElems);
+  lstack = (Lut*) malloc(sizeof(Lut) * maxLStackElems);
   code = (Template*) malloc(sizeof(Template) * MAXTEMPLATES);
   registers = (Atom*) calloc(sizeof(Atom), MAXREGS);
   profTable = (ProfEntry*) malloc(sizeof(ProfEntry) * MAXTEMPLATES);
@@ -700,6 +944,12 @@ void integerAddOverflow(int a, int b)
           a, b, a+b);
 }
 
+void integerMulOverflow(int a, int b)
+{
+    error("integer range exhausted in multiplication of %d*%d = %lld",
+          a, b, (long long) a*b);
+}
+
 /* Succint printing of Atoms and Apps:
    - C2___ for CON 2, arity 3
    - F3__ for FUN 3, arity 2
@@ -734,6 +984,13 @@ void showAtom(Atom a)
         ".&.",
         "st32",
         "ld32",
+        "*",
+        "/",
+        "%",
+        ".|.",
+        ".^.",
+        ".<<.",
+        ".>>.",
     };
 
     switch (a.tag) {
@@ -775,54 +1032,28 @@ void showApp(int addr)
 void dispatch()
 {
   Atom top;
+  TraceRule rule = TR_UNWIND;
+  Int spBefore, hpBefore, uspBefore, lspBefore, arg = 0;
+  Long swaps;
 
   while (!(sp == 1 && stack[0].tag == NUM)) {
       if (sp > maxStackUsage) maxStackUsage = sp;
       if (usp > maxUStackUsage) maxUStackUsage = usp;
       if (lsp > maxLStackUsage) maxLStackUsage = lsp;
 
-    if (sp > MAXSTACKELEMS-50) stackOverflow("stack");
-    if (usp > MAXUSTACKELEMS-4) stackOverflow("update stack");
-    if (lsp > MAXLSTACKELEMS-4) stackOverflow("case stack");
-    if (hp > MAXHEAPAPPS-200 && canCollect()) collect();
-
-    /* Trace */
-
-    if (tracingEnabled) {
-        printf("\n%d:\n", stepno);
-        printf("Heap  :");
-        for (int i = 0; i < hp; ++i)
-            if (heap[i].tag < COLLECTED) {
-                putchar(' ');
-                showApp(i);
-            }
-        printf("\n");
-        printf("Stack :");
-        for (int i = sp - 1; i >= 0; --i) {
-            putchar(' ');
-            showAtom(stack[i]);
-        }
-        printf("\n");
-
-        printf("UStack:");
-        for (int i = usp-1; i >= 0; --i) {
-            printf(" %d-h%d", ustack[i].saddr, ustack[i].haddr);
-        }
-        printf("\n");
-
-        printf("Regs  :");
-        for (int i = 0; i < MAXREGS; ++i) {
-            putchar(' ');
-            showAtom(registers[i]);
-        }
-        printf("\n");
+    if (sp > maxStackElems-STACKMARGIN) stackOverflow("stack");
+    if (usp > maxUStackElems-USTACKMARGIN) stackOverflow("update stack");
+    if (lsp > maxLStackElems-LSTACKMARGIN) stackOverflow("case stack");
+    if (hp > maxHeapApps-HEAPMARGIN && canCollect()) {
+      hpBefore = hp;
+      collect();
+      if (tracingEnabled)
+        trace(TR_GC, sp, hpBefore, usp, lsp, hp, gcCount);
+    }
 
-        printf("LStack:");
-        for (int i = lsp-1; i >= 0; --i) {
-            printf(" %d", lstack[i]);
-        }
-        printf("\n");
+    spBefore = sp; hpBefore = hp; uspBefore = usp; lspBefore = lsp;
 
+    if (checkUniqueness) {
         for (int i = 0; i < MAXREGS; ++i)
             refcntcheck(registers[i]);
         for (int i = 0; i < sp; ++i)
@@ -831,27 +1062,135 @@ void dispatch()
 
     top = stack[sp-1];
     if (top.tag == VAR) {
+      rule = TR_UNWIND; arg = top.contents.var.id;
       unwind(top.contents.var.shared, top.contents.var.id);
       unwindCount++;
     }
     else if (usp > 0 && updateCheck(top, ustack[usp-1])) {
+      rule = TR_UPDATE; arg = ustack[usp-1].haddr;
       update(top, ustack[usp-1].saddr, ustack[usp-1].haddr);
       updateCount++;
     }
     else {
       switch (top.tag) {
-        case NUM: assert(stack[sp-2].tag == PRI); applyPrim(); break;
+        case NUM: assert(stack[sp-2].tag == PRI);
+                  arg = stack[sp-2].contents.pri.id;
+                  swaps = swapCount;
+                  applyPrim();
+                  rule = swapCount != swaps ? TR_SWAP : TR_PRIM;
+                  break;
         case FUN: profTable[top.contents.fun.id].callCount++; applyCount++;
+                  rule = TR_APPLY; arg = traceFun = top.contents.fun.id;
                   apply(&code[top.contents.fun.id]); break;
-        case CON: selectCount++; caseSelect(top.contents.con.index); break;
+        case CON: selectCount++;
+                  rule = TR_SELECT; arg = top.contents.con.index;
+                  caseSelect(top.contents.con.index); break;
         default: error("dispatch(): invalid tag."); break;
       }
     }
 
+    if (tracingEnabled)
+      trace(rule, spBefore, hpBefore, uspBefore, lspBefore, arg, 0);
+
     ++stepno;
   }
 }
 
+/* Trace decoding */
+
+static const char *ruleNames[LAST_TR] = {
+    "unwind", "update", "apply", "prim", "swap", "select",
+    "gc", "ld32", "st32",
+};
+
+/* The apps an application allocated, as far as the template tells:
+   primitive apps only take heap space when they couldn't be reduced
+   speculatively, so if only some did, which is left open */
+
+void showAllocated(const TraceRecord *r)
+{
+  const Template *t = &code[r->arg];
+  Int i, j, addr = r->hp, nonPrim = 0;
+
+  for (i = 0; i < t->numApps; i++)
+    nonPrim += t->apps[i].tag != PRIM;
+
+  for (i = 0; i < t->numApps; i++) {
+    const App *app = &t->apps[i];
+
+    if (app->tag == PRIM && r->alloc != t->numApps) {
+      if (r->alloc == nonPrim) continue;
+      printf("    h?(r%d=", app->details.regId);
+    }
+    else {
+      printf("    h%d(", addr++);
+      if (app->tag == CASE) printf("CASE F%d ", app->details.lut);
+      if (app->tag == PRIM) printf("r%d=", app->details.regId);
+    }
+    for (j = 0; j < app->size; j++) {
+      Atom a = app->atoms[j];
+      if (a.tag == VAR) a.contents.var.id += r->hp;
+      if (j) putchar(' ');
+      showAtom(a);
+    }
+    printf(")\n");
+  }
+}
+
+void showTraceRecord(const TraceRecord *r)
+{
+  printf("%llu: %-6s %-20s sp=%d hp=%d usp=%d lsp=%d",
+         (unsigned long long) r->step, ruleNames[r->rule], code[r->fun].name,
+         r->sp, r->hp, r->usp, r->lsp);
+  switch (r->rule) {
+  case TR_UNWIND:
+  case TR_UPDATE: printf(" h%d", r->arg); break;
+  case TR_PRIM:
+  case TR_SWAP: {
+      Atom p = {.tag = PRI, .contents.pri = {2, 0, r->arg}};
+      putchar(' ');
+      showAtom(p);
+      break;
+  }
+  case TR_SELECT: printf(" alt %d", r->arg); break;
+  case TR_GC: printf(" -> %d live (GC %d)", r->arg, r->arg2); break;
+  case TR_LD32: printf(" [%d] -> %d", r->arg, r->arg2); break;
+  case TR_ST32: printf(" [%d] = %d", r->arg, r->arg2); break;
+  }
+  if (r->alloc) printf(" +%d apps", r->alloc);
+  putchar('\n');
+  if (r->rule == TR_APPLY && r->alloc)
+    showAllocated(r);
+}
+
+void decodeTrace(const char *file)
+{
+  TraceHeader h;
+  TraceRecord r;
+  FILE *f = fopen(file, "rb");
+
+  if (!f) {
+    perror(file);
+    exit(EXIT_FAILURE);
+  }
+  if (fread(&h, sizeof h, 1, f) != 1 ||
+      memcmp(h.magic, TRACEMAGIC, sizeof h.magic) != 0 ||
+      h.version != 1 || h.recordSize != sizeof(TraceRecord))
+    error("%s isn't a trace from this emulator", file);
+
+  printf("%s: %llu of %llu records\n", file,
+         (unsigned long long) h.kept, (unsigned long long) h.recorded);
+  while (fread(&r, sizeof r, 1, f) == 1) {
+    if (r.rule >= LAST_TR || r.fun < 0 || r.fun >= numTemplates ||
+        (r.rule == TR_APPLY && (r.arg < 0 || r.arg >= numTemplates)))
+      error("%s: record for step %llu doesn't match the program", file,
+            (unsigned long long) r.step);
+    if (traceSelected(r.step, r.fun, r.hp))
+      showTraceRecord(&r);
+  }
+  fclose(f);
+}
+
 /* Parser for .red files */
 
 Int strToBool(Char *s)
@@ -880,6 +1219,13 @@ void strToPrim(Char *s, Prim *p, Bool *b)
   if (!strcmp(s, "(.&.)")) { *p = AND; return; }
   if (!strcmp(s, "st32")) { *p = ST32; return; }
   if (!strcmp(s, "ld32")) { *p = LD32; return; }
+  if (!strcmp(s, "(*)")) { *p = MUL; return; }
+  if (!strcmp(s, "(/)")) { *p = QUOT; return; }
+  if (!strcmp(s, "(%)")) { *p = REM; return; }
+  if (!strcmp(s, "(.|.)")) { *p = OR; return; }
+  if (!strcmp(s, "(.^.)")) { *p = XOR; return; }
+  if (!strcmp(s, "(.<<.)")) { *p = SHL; return; }
+  if (!strcmp(s, "(.>>.)")) { *p = SHR; return; }
   error("Parse error: unknown primitive %s", s);
 }
 
@@ -919,7 +1265,7 @@ Bool parseAtom(FILE *f, Atom* result)
     && perform(result->contents.fun.original = strToBool(str))
     )
     ||
-    (  fscanf(f, " PRI%*[ (]%i%*[) ]\"%10[^\"]\"", &result->contents.pri.arity, str)
+    (  fscanf(f, " PRI%*[ (]%i%*[) ]\"%15[^\"]\"", &result->contents.pri.arity, str)
     && perform(result->tag = PRI)
     && perform(strToPrim(str, &result->contents.pri.id,
                               &result->contents.pri.swap))
@@ -1023,6 +1369,29 @@ Int parse(FILE *f, Int n, Template *ts)
   }
 }
 
+/* Sizes given on the command line or in the environment */
+
+Int parseSize(const char *s, const char *what, Int min)
+{
+  char *end;
+  long n = strtol(s, &end, 0);
+
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+  }
+  if (*end != '\0' || n < min || n > 1L << 30)
+    error("invalid %s size %s (must be at least %d)", what, s, min);
+  return n;
+}
+
+void sizeFromEnv(const char *var, const char *what, Int min, Int *size)
+{
+  const char *s = getenv(var);
+
+  if (s && *s) *size = parseSize(s, what, min);
+}
+
 /* Main function */
 
 int main(int argc, char *argv[])
@@ -1032,10 +1401,18 @@ int main(int argc, char *argv[])
   int ch;
   Bool verbose = 0;
   Bool profiling = 0;
+  const char *decodeFile = NULL;
 
   program_name = argv[0];
 
-  while ((ch = getopt(argc, argv, "vtp")) != -1) {
+  sizeFromEnv("REDUCERON_HEAP", "heap", 2*HEAPMARGIN, &maxHeapApps);
+  sizeFromEnv("REDUCERON_STACK", "stack", 2*STACKMARGIN, &maxStackElems);
+  sizeFromEnv("REDUCERON_USTACK", "update stack", 2*USTACKMARGIN,
+              &maxUStackElems);
+  sizeFromEnv("REDUCERON_LSTACK", "case stack", 2*LSTACKMARGIN,
+              &maxLStackElems);
+
+  while ((ch = getopt(argc, argv, "vtpcD:F:R:T:H:M:S:U:L:")) != -1) {
       switch (ch) {
       case 'v':
           verbose = 1;
@@ -1046,8 +1423,39 @@ int main(int argc, char *argv[])
       case 'p':
           profiling = 1;
           break;
+      case 'c':
+          checkUniqueness = 1;
+          break;
+      case 'D':
+          decodeFile = optarg;
+          break;
+      case 'F':
+          addTraceFilter(optarg);
+          break;
+      case 'R':
+          traceRecords = parseSize(optarg, "trace ring", 1);
+          break;
+      case 'T':
+          traceFile = optarg;
+          break;
+      case 'H':
+          maxHeapApps = parseSize(optarg, "heap", 2*HEAPMARGIN);
+          break;
+      case 'M':
+          heapLimit = parseSize(optarg, "heap limit", 2*HEAPMARGIN);
+          break;
+      case 'S':
+          maxStackElems = parseSize(optarg, "stack", 2*STACKMARGIN);
+          break;
+      case 'U':
+          maxUStackElems = parseSize(optarg, "update stack", 2*USTACKMARGIN);
+          break;
+      case 'L':
+          maxLStackElems = parseSize(optarg, "case stack", 2*LSTACKMARGIN);
+          break;
       default:
-          error("only options v, t and p supported");
+          error("only options v, t, p, c, D, F, R, T, H, M, S, U and L "
+                "supported");
           break;
       }
   }
@@ -1068,9 +1476,19 @@ int main(int argc, char *argv[])
       exit(EXIT_FAILURE);
   }
 
+  if (heapLimit && maxHeapApps > heapLimit) maxHeapApps = heapLimit;
+
   alloc();
   numTemplates = parse(f, MAXTEMPLATES, code);
   if (numTemplates <= 0) error("No templates were parsed!");
+  selectTraceFuns();
+
+  if (decodeFile) {
+      decodeTrace(decodeFile);
+      return 0;
+  }
+  if (tracingEnabled)
+      startTrace();
   init();
   dispatch();
 
@@ -1090,6 +1508,7 @@ int main(int argc, char *argv[])
       printf("#GCs        = %12d\n", gcCount);
       printf("#Cases      = %12lld\n", caseCount);
       printf("Max Heap    = %12d\n", maxHeapUsage);
+      printf("Heap Size   = %12d\n", maxHeapApps);
       printf("Max Stack   = %12d\n", maxStackUsage);
       printf("Max UStack  = %12d\n", maxUStackUsage);
       printf("Max LStack  = %12d\n", maxLStackUsage);
@@ -58,13 +58,15 @@
       * Registers      00011s...iiiiiiiiiiiiiiiiiii----- shared,index
       * Functions      00100oAAAiiiiiiiiiiiiiiiiiii----- original,arity,index
       * Invalid        00101lr..iiiiiiiiiiiiiiiiiii----- LUT, REGID, index
+        or Long        00101.010iiiiiiiiiiiiiiiiiiinnnnn numbers,count
 
   Invalid is used to mark unused atom slots and implicitly represents
   the size.  Furthermore, for CASE/PRIM, the LUT/RegId is encoded in
   an Invalid atom in the last atom slot with the corresponding
-  LUT/REGID bits set.  Also, an invalid atom in the first slot
-  indicated the app has been copied by the garbage collection and the
-  second slot holds the new pointer.  For simplicity most atoms share
+  LUT/REGID bits set, and a long app has a Long atom there (see
+  below).  Also, an invalid atom in the first slot indicated the app
+  has been copied by the garbage collection and the second slot holds
+  the new pointer.  For simplicity most atoms share
   layout, but that could be change if some, say functions, needs a
   larger address space.
 
@@ -109,6 +111,18 @@
 
   - The App tag is inferred by the last atom.
 
+  Long apps
+
+  An app of more than APSIZE atoms (a long partial application, as an
+  update writes back) spans consecutive cells rather than being split
+  into a chain of apps.  The first cell is an AP of atoms 0-2 with a
+  LONG atom in the last slot, holding in its HT bits how many more
+  atoms there are (up to MAXLONG) and in its index which of them are
+  numbers; they follow packed four to a cell, bare 32-bit words padded
+  with Invalid atoms.  Code that doesn't know about them sees an app
+  of the first three atoms, so the emulator only lets them reach the
+  places that do: unwinding, updating and garbage collection.
+
   With an HT of 5, we left with 30-5 = 25 bits for the pointer, enough
   for 32 Mi heap cells, a 512 MiB heap.  The more complicated scheme
   reduces HT to 3 bit, thus leaving 27 bits for the pointer (= 128 Mi
@@ -130,7 +144,8 @@ typedef uint32_t UInt;
 
 typedef enum { CON, PRI, ARG, REG, FUN, INV } AtomTag;
 typedef enum { ADD, SUB, EQ, NEQ, LEQ, EMIT, EMITINT, SEQ,
-               AND, ST32, LD32, LAST_PRIM} Prim;
+               AND, ST32, LD32, MUL, QUOT, REM, OR, XOR, SHL, SHR,
+               LAST_PRIM} Prim;
 
 static inline bool isINT(Atom a)              {return a >> 32;}
 static inline Int  getINTValue(Atom a)        {return (Int) a;}
@@ -197,10 +212,18 @@ static inline bool isLUT(Atom a)              {return atomTag(a) == INV && atomB
 static inline UInt getLUTIndex(Atom a)        {return atomIndex(a);}
 static inline Atom mkLUT(UInt i)              {return mkAtom(INV,1,0,i);}
 
-static inline bool isPRIM(Atom a)             {return atomTag(a) == INV && atomArity(a);}
+static inline bool isPRIM(Atom a)             {return atomTag(a) == INV && atomArity(a) == 1;}
 static inline UInt getPRIMDest(Atom a)        {return atomIndex(a);}
 static inline Atom mkPRIM(UInt rd)            {return mkAtom(INV,0,1,rd);}
 
+/* The last atom of the first cell of a long app (see below): how many
+   atoms follow in the cells after it, in the HT bits, and which of
+   them are numbers */
+static inline bool isLONG(Atom a)             {return atomTag(a) == INV && atomArity(a) == 2;}
+static inline UInt getLONGSize(Atom a)        {return a & ~(~0U << HT);}
+static inline UInt getLONGInts(Atom a)        {return atomIndex(a);}
+static inline Atom mkLONG(UInt n, UInt ints)  {return mkAtom(INV,0,2,ints) | n;}
+
 static inline UInt getHT(Atom a)              {return a & ~(~0ULL << HT);}
 static inline Atom setHT(Atom a, UInt ht)     {return (a & (~0ULL << HT)) | ht;}
 
@@ -213,6 +236,9 @@ static inline Atom setHT(Atom a, UInt ht)     {return (a & (~0ULL << HT)) | ht;}
 
 typedef enum { HT_INT0, HT_INT1, HT_INT2, HT_INT3, HT_NF } HeadTag;
 
+#define MAXLONG 16                        // atoms after the first cell
+#define MAXAPPLEN (APSIZE-1 + MAXLONG)    // of a long app
+
 typedef Int Lut;
 
 typedef enum { AP, CASE, PRIM } AppTag;
@@ -0,0 +1,91 @@
+/*
+  libreduceron: running Red programs from C
+
+  The emulator in emu-32-bit.c built as a library (make libreduceron.a
+  or libreduceron.so).  A program is loaded once, from a .red file or
+  an image written by emu-32-bit -o, and is then only read, so any
+  number of machines, on any number of threads, can share it.  Each
+  machine is used by one thread at a time.
+
+    RedProgram *prog;
+    RedMachine *m;
+    RedOptions opts;
+
+    if (redLoadProgram("Fib.red", &prog) != RED_OK) ...
+    redDefaultOptions(&opts);
+    if (redCreateContext(prog, &opts, &m) != RED_OK) ...
+    while ((status = redRun(m, 1000000)) == RED_BUDGET)
+        ; // do other work between slices
+    if (status == RED_OK) printf("%d\n", redResult(m));
+    redDestroy(m);
+    redFreeProgram(prog);
+
+  No call exits the process; failures come back as negative statuses
+  with a message from redErrorMessage().
+*/
+
+#ifndef _REDUCERON_H
+#define _REDUCERON_H 1
+
+#include <stdio.h>
+
+#define REDAPI __attribute__ ((visibility ("default")))
+
+typedef struct RedProgram RedProgram;
+typedef struct RedMachine RedMachine;
+
+typedef enum {
+    RED_OK        =  0,     // done; redRun: the program finished
+    RED_BUDGET    =  1,     // redRun: budget used up, call again to go on
+    RED_HALTED    =  2,     // redRun: the program ran out of serial input
+    RED_EIO       = -1,     // couldn't read a file
+    RED_EPARSE    = -2,     // malformed program or image
+    RED_ENOMEM    = -3,     // out of memory
+    RED_EOVERFLOW = -4,     // heap or a stack is full
+    RED_EINVALID  = -5,     // bad argument or invalid program behaviour
+  } RedStatus;
+
+typedef struct {
+    int heapApps;           // initial heap size, in apps
+    int heapLimit;          // the heap never grows beyond this
+    int nurseryApps;        // 0 for no generational collection
+    int stackElems, ustackElems, lstackElems;
+    int cacheLines;         // heap cache lines, a power of two or 0
+    int threaded;           // use the threaded dispatch engine
+    int jit;                // the threaded engine, templates compiled to
+                            // x86-64 code (ignored elsewhere)
+    int tracing;
+    int squeezeUpdates;     // squeeze the update stack at each GC
+    int asyncSerial;        // serial I/O on threads of its own, reading
+                            // in ahead; in must then stay open until
+                            // the machine is reset or destroyed
+    FILE *in, *out;         // serial I/O; no input if in is NULL
+  } RedOptions;
+
+REDAPI void redDefaultOptions(RedOptions *opts);
+
+REDAPI RedStatus redLoadProgram(const char *file, RedProgram **prog);
+REDAPI void redFreeProgram(RedProgram *prog);
+
+/* A machine ready to run prog from the start.  prog must outlive it. */
+REDAPI RedStatus redCreateContext(const RedProgram *prog,
+                                  const RedOptions *opts, RedMachine **m);
+
+/* Run for about budget ticks (checked before each function
+   application, so slightly more may be used), or to the end if
+   budget <= 0.  After anything other than RED_BUDGET the machine must
+   be reset before running again. */
+REDAPI RedStatus redRun(RedMachine *m, long long budget);
+
+/* Back to the start of the program, keeping the allocated memory */
+REDAPI RedStatus redReset(RedMachine *m);
+
+REDAPI void redDestroy(RedMachine *m);
+
+REDAPI int redResult(const RedMachine *m);
+REDAPI long long redTicks(const RedMachine *m);
+
+/* The message for the last failure on the calling thread */
+REDAPI const char *redErrorMessage(void);
+
+#endif
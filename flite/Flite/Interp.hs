@@ -5,6 +5,8 @@ import Data.Array
 import Flite.InterpFrontend
 import Flite.Inline
 import Data.Bits
+import Data.Int (Int32)
+import Data.Word (Word32)
 
 infixl :@
 
@@ -124,6 +126,13 @@ prims = let (-->) = (,) in
  , "(/=)" --> logical2 (/=)
  , "(<=)" --> logical2 (<=)
  , "(.&.)" --> arith2 (.&.)
+ , "(*)" --> arith2 (*)
+ , "(/)" --> checked2 (checkDiv "/" quot)
+ , "(%)" --> checked2 (checkDiv "%" rem)
+ , "(.|.)" --> arith2 (.|.)
+ , "(.^.)" --> arith2 xor
+ , "(.<<.)" --> checked2 (checkShift ".<<." shl)
+ , "(.>>.)" --> checked2 (checkShift ".>>." shr)
  , "st32" --> (Lam $ \a -> Lam $ \d -> Lam $ \k -> forceInt a $ \a' -> forceInt d $ \d' -> St32 a' d' k)
  , "ld32" --> (Lam $ \a -> Lam $ \d -> forceInt a $ \a' -> forceInt d $ \d' -> N 666)
  , "emit" --> (Lam $ \a -> Lam $ \k -> forceInt a $ \a' -> Emit [toEnum a'] k)
@@ -145,6 +154,36 @@ arith2 op = Lam $ \a -> Lam $ \b ->
     forceInt b $ \b' ->
         N (op a' b')
 
+-- Division and shifts follow the emulator's prim(): a zero divisor or a
+-- negative shift count is an error, x / -1 wraps, and shift counts of 32
+-- or more shift every bit out.
+checked2 :: (Int -> Int -> Val) -> Val
+checked2 op = Lam $ \a -> Lam $ \b ->
+    forceInt a $ \a' ->
+    forceInt b $ \b' ->
+        op a' b'
+
+checkDiv :: String -> (Int -> Int -> Int) -> Int -> Int -> Val
+checkDiv s op n k
+  | k == 0    = Error $ "division by zero in " ++ show n ++ " " ++ s ++ " 0"
+  | k == -1   = N (op (negate n) 1)
+  | otherwise = N (op n k)
+
+checkShift :: String -> (Int -> Int -> Int) -> Int -> Int -> Val
+checkShift s op n k
+  | k < 0     = Error $ "negative shift in " ++ show n ++ " " ++ s ++
+                        " " ++ show k
+  | otherwise = N (op n k)
+
+shl :: Int -> Int -> Int
+shl n k
+  | k >= 32   = 0
+  | otherwise = fromIntegral (fromIntegral (shiftL w k) :: Int32)
+  where w = fromIntegral n :: Word32
+
+shr :: Int -> Int -> Int
+shr n k = shiftR n (min k 31)
+
 logical2 :: (Int -> Int -> Bool) -> Val
 logical2 op = Lam $ \a -> Lam $ \b ->
     forceInt a $ \a' ->
@@ -37,7 +37,8 @@ block :: Parser a -> Parser [a]
 block p = braces (p `sepEndBy` semi) <?> "block"
 
 primitives = ["(+)", "(-)", "(==)", "(/=)", "(<=)", "emit", "emitInt", "(.&.)",
-              "st32", "ld32"]
+              "st32", "ld32", "(*)", "(/)", "(%)", "(.|.)", "(.^.)", "(.<<.)",
+              "(.>>.)"]
 
 -- | Build an application out of an infix operation
 infixApp t x y = App t [x, y]
@@ -52,6 +53,7 @@ infixName = Infix ((symbol "`" *> identifier <* symbol "`") >>= return . infixAp
 binary op assoc = Infix (reservedOp op >> return (infixApp (Fun $ "(" ++ op ++ ")"))) assoc
 
 opTable = [   [infixName, binary "." AssocRight]
+            , [binary "*" AssocLeft]
             , [binary "+" AssocLeft, binary "-" AssocLeft]
             , [binary "==" AssocNone, binary "/=" AssocNone, binary "<=" AssocNone]
             , [binary "$" AssocRight] ]
@@ -50,6 +50,13 @@ isBinaryPrim "(/=)" = True
 isBinaryPrim "(<=)" = True
 isBinaryPrim "(.&.)"  = True
 isBinaryPrim "ld32"  = True
+isBinaryPrim "(*)"  = True
+isBinaryPrim "(/)"  = True
+isBinaryPrim "(%)"  = True
+isBinaryPrim "(.|.)"  = True
+isBinaryPrim "(.^.)"  = True
+isBinaryPrim "(.<<.)"  = True
+isBinaryPrim "(.>>.)"  = True
 isBinaryPrim _      = False
 
 isUnaryPrim :: Id -> Bool
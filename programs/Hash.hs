@@ -0,0 +1,16 @@
+{
+
+hash x = (.^.) ((.&.) ((*) ((.&.) x 4095) 61) 32767) ((.>>.) x 3);
+
+combine a b = (.^.) ((%) ((+) ((.<<.) a 1) b) 65521)
+                    ((.|.) ((.>>.) b 2) ((%) a 7));
+
+range lo hi = case (<=) hi lo of {
+                True  -> hash lo;
+                False -> let { mid = (/) ((+) lo hi) 2 } in
+                           combine (range lo mid) (range ((+) mid 1) hi);
+              };
+
+main = range 1 30000;
+
+}
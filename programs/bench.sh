@@ -0,0 +1,139 @@
+#!/bin/bash
+#
+# Benchmark the emulators on the gold workloads
+#
+#   bench.sh [-n runs] [-w warm-ups] [-e emulators] [-c] [-b baseline]
+#            [-t percent] [-u] [workload ...]
+#
+# Each workload (all of workload-ticks.txt by default) is run -n times
+# (5) after -w warm-up runs (1) by each of the -e emulators ("emu
+# emu-32-bit"), and with -c by its flite -c native binary as well.
+# Reported are the ticks, the median wall-clock time per tick and its
+# spread (half the range, in percent of the median), ticks per second,
+# the share of the time spent collecting (emu-32-bit only) and the
+# most apps live after a collection.
+#
+# A tick count other than the one in workload-ticks.txt, or a median
+# time more than -t percent (10) over the one in the baseline file -b
+# (bench-baseline.txt), is flagged and makes the exit status 1.  -u
+# writes the medians of this run to the baseline file instead.
+
+RUNS=5
+WARMUPS=1
+EMULATORS="emu emu-32-bit"
+NATIVE=0
+BASELINE=bench-baseline.txt
+THRESHOLD=10
+UPDATE=0
+TICKS=workload-ticks.txt
+
+cd "$(dirname "$0")"
+
+while getopts "n:w:e:cb:t:u" opt; do
+  case $opt in
+    n) RUNS=$OPTARG ;;
+    w) WARMUPS=$OPTARG ;;
+    e) EMULATORS=$OPTARG ;;
+    c) NATIVE=1 ;;
+    b) BASELINE=$OPTARG ;;
+    t) THRESHOLD=$OPTARG ;;
+    u) UPDATE=1 ;;
+    *) echo "usage: $0 [-n runs] [-w warm-ups] [-e emulators] [-c]" \
+            "[-b baseline] [-t percent] [-u] [workload ...]" >&2
+       exit 2 ;;
+  esac
+done
+shift $((OPTIND-1))
+
+WORKLOADS=${*:-$(awk 'NR > 1 { print $1 }' $TICKS)}
+
+# The expected ticks of workload $1 under emulator $2, if any
+expected_ticks() {
+  awk -v w=$1 -v e=$2 'NR == 1 { for (i = 2; i <= NF; i++) col[$i] = i }
+                       NR > 1 && $1 == w && col[e] { print $col[e] }' $TICKS
+}
+
+# The baseline seconds of workload $1 under $2, if any
+baseline_time() {
+  [ -f "$BASELINE" ] && awk -v w=$1 -v e=$2 '$1 == e && $2 == w { print $3 }' "$BASELINE"
+}
+
+# Median and spread (half the range, in percent) of the nanoseconds
+# on stdin, as seconds
+median_spread() {
+  sort -n | awk '{ x[NR] = $1 / 1e9 }
+                 END { m = (NR % 2) ? x[(NR+1)/2] : (x[NR/2] + x[NR/2+1]) / 2
+                       printf "%.6f %.1f\n", m, (m > 0) ? 50 * (x[NR] - x[1]) / m : 0 }'
+}
+
+now() { date +%s%N; }
+
+status=0
+newbase=$(mktemp)
+trap 'rm -f "$newbase" bench.$$.out' EXIT
+
+printf "%-10s %-11s %11s %8s %6s %9s %6s %8s %s\n" \
+       runner workload ticks ns/tick "+-%" Mticks/s GC% "max heap" flags
+
+for e in $EMULATORS $([ $NATIVE = 1 ] && echo native); do
+  if [ $e = native ]; then
+    cmd=
+  else
+    make -s -C ../emulator $e || exit 2
+    cmd="../emulator/$e -v"
+  fi
+  for w in $WORKLOADS; do
+    if [ $e = native ]; then
+      make -s $w.exe >/dev/null 2>&1 || { echo "$w.exe: can't build it (flite -c)" >&2; continue; }
+      run="./$w.exe"
+    else
+      run="$cmd gold/compiled/$w.red"
+    fi
+    for ((i = 0; i < WARMUPS; i++)); do
+      $run </dev/null >/dev/null 2>&1
+    done
+    times=
+    for ((i = 0; i < RUNS; i++)); do
+      start=$(now)
+      $run </dev/null >bench.$$.out 2>&1 || { echo "$e $w: failed" >&2; status=1; }
+      end=$(now)
+      times="$times $((end - start))"
+    done
+    ticks=$(awk '/^Ticks/ { print $3 }' bench.$$.out)
+    gc=$(awk '/^GC time/ { sub("%", "", $6); print $6 }' bench.$$.out)
+    heap=$(awk '/^Max Heap/ { print $4 }' bench.$$.out)
+    read med spread < <(printf '%s\n' $times | median_spread)
+
+    flags=
+    want=$(expected_ticks $w $e)
+    if [ -n "$ticks" ] && [ -n "$want" ] && [ "$ticks" != "$want" ]; then
+      flags="$flags TICKS($want)"
+    fi
+    base=$(baseline_time $w $e)
+    if [ $UPDATE = 0 ] && [ -n "$base" ]; then
+      flags="$flags$(awk -v m=$med -v b=$base -v t=$THRESHOLD \
+        'BEGIN { if (m > b * (1 + t/100)) printf " SLOWER(+%.1f%%)", 100 * (m-b) / b }')"
+    fi
+    [ -n "$flags" ] && status=1
+    echo "$e $w $med" >> "$newbase"
+
+    if [ -n "$ticks" ] && [ "$ticks" -gt 0 ]; then
+      read nspt mtps < <(awk -v m=$med -v n=$ticks \
+        'BEGIN { printf "%.2f %.2f\n", m * 1e9 / n, n / m / 1e6 }')
+    else
+      ticks=- nspt=- mtps=-
+    fi
+    printf "%-10s %-11s %11s %8s %6s %9s %6s %8s %s\n" $e $w $ticks $nspt \
+           $spread $mtps ${gc:--} ${heap:--} "${flags# }"
+  done
+done
+
+# Replacing the baselines of what ran, keeping the rest
+if [ $UPDATE = 1 ]; then
+  touch "$BASELINE"
+  awk 'NR == FNR { new[$1 " " $2] = 1; print; next }
+       !(($1 " " $2) in new)' "$newbase" "$BASELINE" > "$newbase.all" &&
+    mv "$newbase.all" "$BASELINE"
+  echo "baseline written to $BASELINE"
+fi
+exit $status